@@ -0,0 +1,92 @@
+#ifndef BIN_ACCUMULATOR_H
+#define BIN_ACCUMULATOR_H
+
+#include <vector>
+#include <cmath>   // For std::sqrt
+#include <cstddef> // For std::size_t
+#include "BinKernels.h"
+
+// Streaming per-bin accumulator of weight, mean and second central moment (M2).
+//
+// Values are folded in one at a time with Welford's (weighted) update, which never
+// subtracts two large sums and so stays accurate for bin contents of 1e9 and more.
+// Two accumulators filled from disjoint inputs can be combined with Chan et al.'s
+// parallel formula; splitting the inputs into groups, merging the groups separately
+// and combining the partial accumulators gives the same moments as one serial pass
+// up to rounding.
+//
+// The three quantities are kept in separate contiguous arrays indexed by global bin.
+class BinAccumulator {
+public:
+    BinAccumulator() = default;
+    explicit BinAccumulator(std::size_t nBins) : fWeight(nBins, 0.0), fMean(nBins, 0.0), fM2(nBins, 0.0) {}
+
+    std::size_t Size() const { return fMean.size(); }
+
+    // Clear all bins, keeping the size
+    void Reset() {
+        fWeight.assign(fWeight.size(), 0.0);
+        fMean.assign(fMean.size(), 0.0);
+        fM2.assign(fM2.size(), 0.0);
+    }
+
+    // Fold value x with weight w into one bin
+    void Fill(std::size_t bin, double x, double w = 1.0) {
+        double weight = fWeight[bin] + w;
+        if (weight <= 0.0) return;
+        double delta = x - fMean[bin];
+        fMean[bin] += delta * (w / weight);
+        fM2[bin] += w * delta * (x - fMean[bin]);
+        fWeight[bin] = weight;
+    }
+
+    // Fold a whole bin array (one input) with a common weight w into all bins.
+    // Double and float arrays go through the SIMD kernels of BinKernels.h.
+    template <typename T>
+    void FillArray(const T* values, double w = 1.0) {
+        if (w <= 0.0) return;
+        BinKernels::Fold(values, w, fWeight.data(), fMean.data(), fM2.data(), Size());
+    }
+
+    // Combine a partial accumulator filled from other inputs into this one.
+    // Returns false, leaving this accumulator untouched, if the sizes differ.
+    bool Merge(const BinAccumulator& other) {
+        if (other.Size() != Size()) return false;
+        for (std::size_t bin = 0; bin < Size(); ++bin) {
+            double wB = other.fWeight[bin];
+            if (wB == 0.0) continue;
+            double wA = fWeight[bin];
+            double weight = wA + wB;
+            double delta = other.fMean[bin] - fMean[bin];
+            fMean[bin] += delta * (wB / weight);
+            fM2[bin] += other.fM2[bin] + delta * delta * (wA * wB / weight);
+            fWeight[bin] = weight;
+        }
+        return true;
+    }
+
+    double Weight(std::size_t bin) const { return fWeight[bin]; }
+    double Mean(std::size_t bin) const { return fMean[bin]; }
+    double M2(std::size_t bin) const { return fM2[bin]; }
+
+    // Population variance (normalized by the total weight), zero for empty bins
+    double Variance(std::size_t bin) const {
+        return fWeight[bin] > 0.0 && fM2[bin] > 0.0 ? fM2[bin] / fWeight[bin] : 0.0;
+    }
+    double StdDev(std::size_t bin) const { return std::sqrt(Variance(bin)); }
+
+    // Raw contiguous storage, e.g. for bulk kernels and persistence
+    double* GetWeightArray() { return fWeight.data(); }
+    double* GetMeanArray() { return fMean.data(); }
+    double* GetM2Array() { return fM2.data(); }
+    const double* GetWeightArray() const { return fWeight.data(); }
+    const double* GetMeanArray() const { return fMean.data(); }
+    const double* GetM2Array() const { return fM2.data(); }
+
+private:
+    std::vector<double> fWeight; // Sum of weights folded into each bin (the count for unit weights)
+    std::vector<double> fMean;   // Running weighted mean of each bin
+    std::vector<double> fM2;     // Running sum of weighted squared deviations from the mean
+};
+
+#endif // BIN_ACCUMULATOR_H
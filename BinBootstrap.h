@@ -0,0 +1,124 @@
+#ifndef BIN_BOOTSTRAP_H
+#define BIN_BOOTSTRAP_H
+
+#include <vector>
+#include <string>
+#include <algorithm> // For std::sort
+#include <cstddef>   // For std::size_t
+#include <cstdint>   // For std::uint64_t
+
+// Streaming Poisson bootstrap of the per-bin mean over replicas.
+//
+// Instead of drawing B resamples of the replica set up front, every replica enters
+// resample b with a weight drawn from Poisson(1), which in the limit of many replicas is
+// the multiplicity an ordinary resample would give it. Each resample then only needs
+// the weighted sum of the bin contents and the sum of the weights, so the replicas are
+// folded in one at a time like for BinAccumulator, and sketches of disjoint inputs are
+// merged by adding them.
+//
+// The weights of a replica are derived from a seed and a key identifying the replica
+// (its file name), not from the order it is read in, so threads, streaming passes and
+// hierarchical merges all give the same resamples.
+class BinBootstrap {
+public:
+    BinBootstrap() = default;
+    BinBootstrap(std::size_t nBins, std::size_t nResamples)
+        : fNBins(nBins), fSum(nBins * nResamples, 0.0), fWeight(nResamples, 0.0) {}
+
+    std::size_t Size() const { return fNBins; }
+    std::size_t Resamples() const { return fWeight.size(); }
+
+    // Poisson(1) weight of a replica in each of the nResamples resamples, from a
+    // counter-based generator keyed by seed and replica
+    static std::vector<double> PoissonWeights(std::uint64_t seed, const std::string& replica, std::size_t nResamples) {
+        std::uint64_t key = 14695981039346656037ull; // FNV-1a of the replica name
+        for (unsigned char c : replica) key = (key ^ c) * 1099511628211ull;
+        std::vector<double> weights(nResamples);
+        for (std::size_t b = 0; b < nResamples; ++b) {
+            double u = (Mix(seed ^ Mix(key + b)) >> 11) * 0x1.0p-53;
+            // Invert the cumulative distribution, P(k) = e^-1 / k!
+            double p = 0.36787944117144233, cumulative = p;
+            unsigned k = 0;
+            while (u > cumulative && k < 20) {
+                p /= ++k;
+                cumulative += p;
+            }
+            weights[b] = k;
+        }
+        return weights;
+    }
+
+    // Fold the content x of one bin of a replica, with its weight in every resample
+    void Fill(std::size_t bin, double x, const double* weights) {
+        for (std::size_t b = 0; b < Resamples(); ++b) fSum[b * fNBins + bin] += weights[b] * x;
+    }
+
+    // Fold a whole bin array (one replica) with its weight in every resample. Either way
+    // the weights are counted separately, once per replica, with AddWeights().
+    template <typename T>
+    void FillArray(const T* values, const double* weights) {
+        for (std::size_t b = 0; b < Resamples(); ++b) {
+            if (weights[b] == 0.0) continue;
+            double w = weights[b];
+            double* sum = &fSum[b * fNBins];
+            for (std::size_t bin = 0; bin < fNBins; ++bin) sum[bin] += w * values[bin];
+        }
+    }
+
+    // Count the weights of a replica in every resample
+    void AddWeights(const double* weights) {
+        for (std::size_t b = 0; b < Resamples(); ++b) fWeight[b] += weights[b];
+    }
+
+    // Combine a bootstrap of other replicas with the same resamples into this one.
+    // Returns false, leaving this one untouched, if the shapes differ.
+    bool Merge(const BinBootstrap& other) {
+        if (other.Size() != Size() || other.Resamples() != Resamples()) return false;
+        for (std::size_t i = 0; i < fSum.size(); ++i) fSum[i] += other.fSum[i];
+        for (std::size_t b = 0; b < Resamples(); ++b) fWeight[b] += other.fWeight[b];
+        return true;
+    }
+
+    // Percentiles qs[k] (0 to 1) of the resampled means of one bin, interpolated between
+    // order statistics; resamples that drew no replica at all are left out
+    void Percentiles(std::size_t bin, const double* qs, std::size_t nLevels, double* result) const {
+        std::vector<double> means;
+        means.reserve(Resamples());
+        for (std::size_t b = 0; b < Resamples(); ++b) {
+            if (fWeight[b] > 0.0) means.push_back(fSum[b * fNBins + bin] / fWeight[b]);
+        }
+        std::sort(means.begin(), means.end());
+        for (std::size_t k = 0; k < nLevels; ++k) {
+            if (means.empty()) {
+                result[k] = 0.0;
+                continue;
+            }
+            double position = qs[k] * (means.size() - 1);
+            std::size_t below = (std::size_t)position;
+            std::size_t above = std::min(below + 1, means.size() - 1);
+            result[k] = means[below] + (position - below) * (means[above] - means[below]);
+        }
+    }
+
+    // Raw storage, e.g. for persistence: the weighted sums, resample-major, and the
+    // total weight of each resample
+    double* GetSumArray() { return fSum.data(); }
+    double* GetWeightArray() { return fWeight.data(); }
+    const double* GetSumArray() const { return fSum.data(); }
+    const double* GetWeightArray() const { return fWeight.data(); }
+
+private:
+    // SplitMix64 finalizer
+    static std::uint64_t Mix(std::uint64_t z) {
+        z += 0x9e3779b97f4a7c15ull;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    std::size_t fNBins = 0;
+    std::vector<double> fSum;    // Per resample and bin: sum of weight x content, resample-major
+    std::vector<double> fWeight; // Per resample: sum of the replica weights
+};
+
+#endif // BIN_BOOTSTRAP_H
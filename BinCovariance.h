@@ -0,0 +1,182 @@
+#ifndef BIN_COVARIANCE_H
+#define BIN_COVARIANCE_H
+
+#include <vector>
+#include <functional>
+#include <utility>   // For std::move
+#include <algorithm> // For std::min
+#include <cstddef>   // For std::size_t
+
+// Streaming bin-to-bin covariance of a histogram over replicas: the weighted mean of
+// every bin and the co-moment C(j, k) = sum_r w_r (x_rj - mean_j)(x_rk - mean_k).
+//
+// Replicas are buffered in blocks of BlockSize() rows. A full block is centred on its
+// own mean and added as one rank-k update of the lower triangle (the dsyrk of BLAS),
+// cache-blocked in tiles of kTileRows rows by kTileColumns columns and, with
+// SetExecutor(), spread over threads by tile rows; the block is then combined with the
+// running moments by Chan's parallel formula, a single rank-1 correction. Two
+// covariances of disjoint inputs combine the same way.
+//
+// Only the lower triangle is stored, packed row by row, and with a band only the band:
+// row j keeps columns max(0, j - band) to j. Memory is fixed up front at 8 bytes per
+// stored element plus the block buffer, e.g. 16 MB for the full matrix of 2000 bins.
+class BinCovariance {
+public:
+    // Runs body(t) for every t in [0, n), possibly in parallel
+    using Executor = std::function<void(std::size_t n, const std::function<void(std::size_t)>& body)>;
+
+    static constexpr std::size_t kDefaultBlockSize = 32;
+    static constexpr std::size_t kTileRows = 64;
+    static constexpr std::size_t kTileColumns = 256;
+
+    BinCovariance() = default;
+    // band 0 keeps the full matrix
+    BinCovariance(std::size_t nBins, std::size_t band, std::size_t blockSize = kDefaultBlockSize)
+        : fNBins(nBins), fBand(band == 0 || band >= nBins ? (nBins ? nBins - 1 : 0) : band),
+          fBlockSize(blockSize), fMean(nBins, 0.0), fRowStart(nBins + 1, 0) {
+        for (std::size_t j = 0; j < nBins; ++j) fRowStart[j + 1] = fRowStart[j] + j - First(j) + 1;
+        fComoment.assign(fRowStart[nBins], 0.0);
+        fBlock.reserve(fBlockSize * nBins);
+    }
+
+    std::size_t Size() const { return fNBins; }
+    std::size_t Band() const { return fBand; }
+    std::size_t BlockSize() const { return fBlockSize; }
+    // Where every Flush() runs its tile rows, e.g. on a ROOT::TThreadExecutor; serially
+    // by default. The executor must accept work from its own tasks if the caller is one.
+    void SetExecutor(Executor executor) { fExecutor = std::move(executor); }
+
+    // Bytes held for nBins bins with a band (0 for the full matrix)
+    static std::size_t Footprint(std::size_t nBins, std::size_t band, std::size_t blockSize = kDefaultBlockSize) {
+        std::size_t stored = band == 0 || band >= nBins ? nBins * (nBins + 1) / 2 : nBins * (band + 1);
+        return 8 * (stored + blockSize * nBins + 2 * nBins);
+    }
+
+    // Fold the bin contents of one replica with weight w
+    template <typename T>
+    void Fill(const T* values, double w = 1.0) {
+        if (w <= 0.0) return;
+        fBlock.insert(fBlock.end(), values, values + fNBins);
+        fBlockWeight.push_back(w);
+        if (fBlockWeight.size() == fBlockSize) Flush();
+    }
+
+    // Add the buffered replicas to the moments
+    void Flush() {
+        const std::size_t nRows = fBlockWeight.size();
+        if (nRows == 0) return;
+
+        // Centre the block on its own weighted mean
+        double blockWeight = 0.0;
+        std::vector<double> blockMean(fNBins, 0.0);
+        for (std::size_t r = 0; r < nRows; ++r) {
+            blockWeight += fBlockWeight[r];
+            const double* x = &fBlock[r * fNBins];
+            for (std::size_t j = 0; j < fNBins; ++j) blockMean[j] += fBlockWeight[r] * x[j];
+        }
+        for (auto& m : blockMean) m /= blockWeight;
+        for (std::size_t r = 0; r < nRows; ++r) {
+            double* x = &fBlock[r * fNBins];
+            for (std::size_t j = 0; j < fNBins; ++j) x[j] -= blockMean[j];
+        }
+
+        // Rank-k update, tile row by tile row; the bottom ones are the longest, so they
+        // are handed out first
+        const std::size_t nTileRows = (fNBins + kTileRows - 1) / kTileRows;
+        auto body = [&](std::size_t t) { UpdateTileRow(nTileRows - 1 - t, nRows); };
+        if (fExecutor && nTileRows > 1) {
+            fExecutor(nTileRows, body);
+        } else {
+            for (std::size_t t = 0; t < nTileRows; ++t) body(t);
+        }
+
+        fBlock.clear();
+        fBlockWeight.clear();
+        CombineMoments(blockWeight, blockMean.data(), nullptr);
+    }
+
+    // Combine the covariance of other replicas into this one, including the replicas it
+    // still buffers. Returns false, leaving this one untouched, if the numbers of bins or
+    // the bands differ.
+    bool Merge(const BinCovariance& other) {
+        if (other.Size() != Size() || other.Band() != Band()) return false;
+        Flush();
+        CombineMoments(other.fWeight, other.fMean.data(), other.fComoment.data());
+        for (std::size_t r = 0; r < other.fBlockWeight.size(); ++r) Fill(&other.fBlock[r * fNBins], other.fBlockWeight[r]);
+        return true;
+    }
+
+    double Weight() const { return fWeight; }
+    double Mean(std::size_t bin) const { return fMean[bin]; }
+    // Co-moment of two bins, 0 outside the band; Flush() first
+    double Comoment(std::size_t j, std::size_t k) const {
+        if (k > j) std::swap(j, k);
+        return k < First(j) ? 0.0 : fComoment[fRowStart[j] + k - First(j)];
+    }
+
+    // Raw storage, e.g. for persistence: means and the packed co-moments. Flush() first;
+    // SetWeight() after filling them directly.
+    double* GetMeanArray() { return fMean.data(); }
+    double* GetComomentArray() { return fComoment.data(); }
+    const double* GetMeanArray() const { return fMean.data(); }
+    const double* GetComomentArray() const { return fComoment.data(); }
+    std::size_t ComomentSize() const { return fComoment.size(); }
+    void SetWeight(double weight) { fWeight = weight; }
+
+private:
+    // First column stored in row j
+    std::size_t First(std::size_t j) const { return j > fBand ? j - fBand : 0; }
+
+    // C(j, k) += sum_r w_r d_rj d_rk for the rows of one tile row, column tile by column
+    // tile, so that the block columns of a tile stay in cache for all its rows
+    void UpdateTileRow(std::size_t tileRow, std::size_t nRows) {
+        std::size_t rowBegin = tileRow * kTileRows;
+        std::size_t rowEnd = std::min(rowBegin + kTileRows, fNBins);
+        for (std::size_t colBegin = First(rowBegin); colBegin < rowEnd; colBegin += kTileColumns) {
+            std::size_t colEnd = std::min(colBegin + kTileColumns, rowEnd);
+            for (std::size_t j = rowBegin; j < rowEnd; ++j) {
+                std::size_t lo = std::max(colBegin, First(j));
+                std::size_t hi = std::min(colEnd, j + 1);
+                if (lo >= hi) continue;
+                double* c = &fComoment[fRowStart[j] + lo - First(j)];
+                for (std::size_t r = 0; r < nRows; ++r) {
+                    const double* d = &fBlock[r * fNBins];
+                    double a = fBlockWeight[r] * d[j];
+                    for (std::size_t k = lo; k < hi; ++k) c[k - lo] += a * d[k];
+                }
+            }
+        }
+    }
+
+    // Chan's formula: add moments (weight, mean, comoment) of other replicas, whose
+    // co-moments are already in fComoment if comoment is nullptr
+    void CombineMoments(double weight, const double* mean, const double* comoment) {
+        if (weight <= 0.0) return;
+        double total = fWeight + weight;
+        double factor = fWeight * weight / total;
+        std::vector<double> delta(fNBins);
+        for (std::size_t j = 0; j < fNBins; ++j) delta[j] = mean[j] - fMean[j];
+        for (std::size_t j = 0; j < fNBins; ++j) {
+            double* c = &fComoment[fRowStart[j]];
+            const double* o = comoment ? &comoment[fRowStart[j]] : nullptr;
+            for (std::size_t k = First(j); k <= j; ++k) {
+                c[k - First(j)] += factor * delta[j] * delta[k] + (o ? o[k - First(j)] : 0.0);
+            }
+        }
+        for (std::size_t j = 0; j < fNBins; ++j) fMean[j] += delta[j] * (weight / total);
+        fWeight = total;
+    }
+
+    std::size_t fNBins = 0;
+    std::size_t fBand = 0;                 // Columns kept left of the diagonal
+    std::size_t fBlockSize = kDefaultBlockSize;
+    Executor fExecutor;                    // Runs the tile rows of Flush(), serial if empty
+    double fWeight = 0.0;                  // Sum of the weights of the flushed replicas
+    std::vector<double> fMean;             // Weighted mean of every bin
+    std::vector<std::size_t> fRowStart;    // Start of each row in fComoment
+    std::vector<double> fComoment;         // Lower triangle (or band), packed by rows
+    std::vector<double> fBlock;            // Buffered replicas, row-major
+    std::vector<double> fBlockWeight;      // Their weights
+};
+
+#endif // BIN_COVARIANCE_H
@@ -0,0 +1,120 @@
+#ifndef BIN_JACKKNIFE_H
+#define BIN_JACKKNIFE_H
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <cstddef> // For std::size_t
+
+// Per-replica bin contents of one histogram, kept for delete-one jackknife estimates of
+// quantities that are not linear in the replicas, such as the ratio of two merged
+// histograms.
+//
+// Every replica adds one row of bin contents with its weight and a key naming it;
+// replicas of two histograms are matched by key. The rows of disjoint inputs are merged
+// by appending them. Contents are kept as double: the delete-one ratios differ little
+// from each other, so rounding contents to float would swamp their spread. Memory is 8
+// bytes per bin and replica, so only histograms that need it keep their replicas.
+class BinJackknife {
+public:
+    BinJackknife() = default;
+    explicit BinJackknife(std::size_t nBins) : fNBins(nBins) {}
+
+    std::size_t Size() const { return fNBins; }
+    std::size_t Replicas() const { return fWeight.size(); }
+
+    // Add the bin contents of one replica
+    template <typename T>
+    void AddReplica(const std::string& key, double weight, const T* values) {
+        fKey.push_back(key);
+        fWeight.push_back(weight);
+        fValue.insert(fValue.end(), values, values + fNBins);
+    }
+
+    // Append the replicas of other inputs. Returns false, leaving this one untouched, if
+    // the numbers of bins differ.
+    bool Merge(const BinJackknife& other) {
+        if (other.Size() != Size()) return false;
+        fKey.insert(fKey.end(), other.fKey.begin(), other.fKey.end());
+        fWeight.insert(fWeight.end(), other.fWeight.begin(), other.fWeight.end());
+        fValue.insert(fValue.end(), other.fValue.begin(), other.fValue.end());
+        return true;
+    }
+
+    // Ratio of the weighted means of numerator and denominator per bin, and its delete-one
+    // jackknife variance over the replicas both hold:
+    //
+    //     R_i = (A - w_i a_i) / (B - w_i b_i)
+    //     var = (n - 1) / n * sum_i (R_i - mean_i R_i)^2
+    //
+    // with A and B the weighted sums of the bin. Bins with an empty denominator get 0;
+    // replicas whose removal empties it are left out of that bin. Returns the number of
+    // replicas matched; O(bins x replicas).
+    static std::size_t Ratio(const BinJackknife& numerator, const BinJackknife& denominator,
+                             std::vector<double>& ratio, std::vector<double>& variance) {
+        const std::size_t nBins = numerator.Size();
+        ratio.assign(nBins, 0.0);
+        variance.assign(nBins, 0.0);
+        if (denominator.Size() != nBins) return 0;
+
+        // Replicas present in both, as row pairs
+        std::unordered_map<std::string, std::size_t> denominatorRow;
+        for (std::size_t r = 0; r < denominator.Replicas(); ++r) denominatorRow.emplace(denominator.fKey[r], r);
+        std::vector<std::size_t> rowA, rowB;
+        for (std::size_t r = 0; r < numerator.Replicas(); ++r) {
+            auto found = denominatorRow.find(numerator.fKey[r]);
+            if (found == denominatorRow.end()) continue;
+            rowA.push_back(r);
+            rowB.push_back(found->second);
+        }
+        const std::size_t n = rowA.size();
+        if (n == 0) return 0;
+
+        std::vector<double> sumA(nBins, 0.0), sumB(nBins, 0.0);
+        for (std::size_t i = 0; i < n; ++i) {
+            double w = numerator.fWeight[rowA[i]];
+            const double* a = &numerator.fValue[rowA[i] * nBins];
+            const double* b = &denominator.fValue[rowB[i] * nBins];
+            for (std::size_t bin = 0; bin < nBins; ++bin) {
+                sumA[bin] += w * a[bin];
+                sumB[bin] += w * b[bin];
+            }
+        }
+
+        // Running mean and M2 of the delete-one ratios of every bin
+        std::vector<double> count(nBins, 0.0), mean(nBins, 0.0), m2(nBins, 0.0);
+        for (std::size_t i = 0; i < n; ++i) {
+            double w = numerator.fWeight[rowA[i]];
+            const double* a = &numerator.fValue[rowA[i] * nBins];
+            const double* b = &denominator.fValue[rowB[i] * nBins];
+            for (std::size_t bin = 0; bin < nBins; ++bin) {
+                double rest = sumB[bin] - w * b[bin];
+                if (rest == 0.0) continue;
+                double r = (sumA[bin] - w * a[bin]) / rest;
+                count[bin] += 1.0;
+                double delta = r - mean[bin];
+                mean[bin] += delta / count[bin];
+                m2[bin] += delta * (r - mean[bin]);
+            }
+        }
+        for (std::size_t bin = 0; bin < nBins; ++bin) {
+            if (sumB[bin] != 0.0) ratio[bin] = sumA[bin] / sumB[bin];
+            if (count[bin] > 1.0) variance[bin] = (count[bin] - 1.0) / count[bin] * m2[bin];
+        }
+        return n;
+    }
+
+    // Raw storage, e.g. for persistence: keys and weights per replica, and the bin
+    // contents replica-major
+    const std::vector<std::string>& Keys() const { return fKey; }
+    const std::vector<double>& Weights() const { return fWeight; }
+    const std::vector<double>& Values() const { return fValue; }
+
+private:
+    std::size_t fNBins = 0;
+    std::vector<std::string> fKey; // Per replica: its name
+    std::vector<double> fWeight;   // Per replica: its weight
+    std::vector<double> fValue;    // Per replica and bin: the content, replica-major
+};
+
+#endif // BIN_JACKKNIFE_H
@@ -0,0 +1,161 @@
+#ifndef BIN_KERNELS_H
+#define BIN_KERNELS_H
+
+#include <cstddef> // For std::size_t
+
+// Kernels folding one input's bin array into per-bin weight/mean/M2 arrays
+// (the weighted Welford update used by BinAccumulator):
+//
+//     weight += w;  delta = x - mean;  mean += delta * (w / weight);  m2 += w * delta * (x - mean);
+//
+// There is a scalar version for any value type and AVX2 / AVX-512 versions for double
+// and float inputs; float bins are widened to double as they are loaded. The vector
+// versions are selected at run time from the CPU features. They are written with
+// separate multiply and add and IEEE division, so they agree with the scalar loop to
+// rounding, and bit for bit when the compiler does not contract to FMA
+// (-ffp-contract=off).
+//
+// The vector kernels are only built by a real compiler on x86; when the macro is run
+// through the interpreter the scalar loop is used.
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__)) && !defined(__CLING__)
+#define BIN_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+namespace BinKernels {
+
+// Scalar update of bins [begin, end)
+template <typename T>
+inline void FoldScalar(const T* values, double w, double* weight, double* mean, double* m2,
+                       std::size_t begin, std::size_t end) {
+    for (std::size_t bin = begin; bin < end; ++bin) {
+        double x = values[bin];
+        double sumW = weight[bin] + w;
+        double delta = x - mean[bin];
+        mean[bin] += delta * (w / sumW);
+        m2[bin] += w * delta * (x - mean[bin]);
+        weight[bin] = sumW;
+    }
+}
+
+#ifdef BIN_KERNELS_X86
+
+__attribute__((target("avx2")))
+inline void FoldAvx2Step(__m256d x, __m256d vw, double* weight, double* mean, double* m2) {
+    __m256d sumW = _mm256_add_pd(_mm256_loadu_pd(weight), vw);
+    __m256d mu = _mm256_loadu_pd(mean);
+    __m256d delta = _mm256_sub_pd(x, mu);
+    mu = _mm256_add_pd(mu, _mm256_mul_pd(delta, _mm256_div_pd(vw, sumW)));
+    __m256d dm2 = _mm256_mul_pd(_mm256_mul_pd(vw, delta), _mm256_sub_pd(x, mu));
+    _mm256_storeu_pd(m2, _mm256_add_pd(_mm256_loadu_pd(m2), dm2));
+    _mm256_storeu_pd(mean, mu);
+    _mm256_storeu_pd(weight, sumW);
+}
+
+__attribute__((target("avx2")))
+inline void FoldAvx2(const double* values, double w, double* weight, double* mean, double* m2, std::size_t n) {
+    const __m256d vw = _mm256_set1_pd(w);
+    std::size_t bin = 0;
+    for (; bin + 4 <= n; bin += 4) {
+        FoldAvx2Step(_mm256_loadu_pd(values + bin), vw, weight + bin, mean + bin, m2 + bin);
+    }
+    FoldScalar(values, w, weight, mean, m2, bin, n);
+}
+
+__attribute__((target("avx2")))
+inline void FoldAvx2(const float* values, double w, double* weight, double* mean, double* m2, std::size_t n) {
+    const __m256d vw = _mm256_set1_pd(w);
+    std::size_t bin = 0;
+    for (; bin + 4 <= n; bin += 4) {
+        FoldAvx2Step(_mm256_cvtps_pd(_mm_loadu_ps(values + bin)), vw, weight + bin, mean + bin, m2 + bin);
+    }
+    FoldScalar(values, w, weight, mean, m2, bin, n);
+}
+
+__attribute__((target("avx512f")))
+inline void FoldAvx512Step(__m512d x, __m512d vw, double* weight, double* mean, double* m2) {
+    __m512d sumW = _mm512_add_pd(_mm512_loadu_pd(weight), vw);
+    __m512d mu = _mm512_loadu_pd(mean);
+    __m512d delta = _mm512_sub_pd(x, mu);
+    mu = _mm512_add_pd(mu, _mm512_mul_pd(delta, _mm512_div_pd(vw, sumW)));
+    __m512d dm2 = _mm512_mul_pd(_mm512_mul_pd(vw, delta), _mm512_sub_pd(x, mu));
+    _mm512_storeu_pd(m2, _mm512_add_pd(_mm512_loadu_pd(m2), dm2));
+    _mm512_storeu_pd(mean, mu);
+    _mm512_storeu_pd(weight, sumW);
+}
+
+__attribute__((target("avx512f")))
+inline void FoldAvx512(const double* values, double w, double* weight, double* mean, double* m2, std::size_t n) {
+    const __m512d vw = _mm512_set1_pd(w);
+    std::size_t bin = 0;
+    for (; bin + 8 <= n; bin += 8) {
+        FoldAvx512Step(_mm512_loadu_pd(values + bin), vw, weight + bin, mean + bin, m2 + bin);
+    }
+    FoldScalar(values, w, weight, mean, m2, bin, n);
+}
+
+__attribute__((target("avx512f")))
+inline void FoldAvx512(const float* values, double w, double* weight, double* mean, double* m2, std::size_t n) {
+    const __m512d vw = _mm512_set1_pd(w);
+    std::size_t bin = 0;
+    for (; bin + 8 <= n; bin += 8) {
+        FoldAvx512Step(_mm512_cvtps_pd(_mm256_loadu_ps(values + bin)), vw, weight + bin, mean + bin, m2 + bin);
+    }
+    FoldScalar(values, w, weight, mean, m2, bin, n);
+}
+
+#endif // BIN_KERNELS_X86
+
+// Instruction set used by the dispatching Fold()
+enum class Isa { kScalar, kAvx2, kAvx512 };
+
+inline Isa DetectIsa() {
+#ifdef BIN_KERNELS_X86
+    static const Isa isa = __builtin_cpu_supports("avx512f") ? Isa::kAvx512
+                         : __builtin_cpu_supports("avx2")    ? Isa::kAvx2
+                                                             : Isa::kScalar;
+    return isa;
+#else
+    return Isa::kScalar;
+#endif
+}
+
+inline const char* IsaName(Isa isa) {
+    switch (isa) {
+        case Isa::kAvx512: return "AVX-512";
+        case Isa::kAvx2:   return "AVX2";
+        default:           return "scalar";
+    }
+}
+
+// Fold n bins of one input with weight w. Bin types other than double and float
+// (int, short and char histograms) only have the scalar loop.
+template <typename T>
+inline void Fold(const T* values, double w, double* weight, double* mean, double* m2, std::size_t n) {
+    FoldScalar(values, w, weight, mean, m2, 0, n);
+}
+
+// Double and float bins use the widest kernel the CPU supports
+template <typename T>
+inline void FoldDispatch(const T* values, double w, double* weight, double* mean, double* m2, std::size_t n) {
+#ifdef BIN_KERNELS_X86
+    switch (DetectIsa()) {
+        case Isa::kAvx512: FoldAvx512(values, w, weight, mean, m2, n); return;
+        case Isa::kAvx2:   FoldAvx2(values, w, weight, mean, m2, n); return;
+        default: break;
+    }
+#endif
+    FoldScalar(values, w, weight, mean, m2, 0, n);
+}
+
+inline void Fold(const double* values, double w, double* weight, double* mean, double* m2, std::size_t n) {
+    FoldDispatch(values, w, weight, mean, m2, n);
+}
+
+inline void Fold(const float* values, double w, double* weight, double* mean, double* m2, std::size_t n) {
+    FoldDispatch(values, w, weight, mean, m2, n);
+}
+
+} // namespace BinKernels
+
+#endif // BIN_KERNELS_H
@@ -0,0 +1,183 @@
+#ifndef BIN_QUANTILES_H
+#define BIN_QUANTILES_H
+
+#include <vector>
+#include <algorithm> // For std::sort
+#include <cmath>     // For std::asin
+#include <cstddef>   // For std::size_t
+
+// Streaming per-bin quantile sketch: a small t-digest for every bin.
+//
+// Each bin holds at most Capacity() centroids (mean, weight). Values are appended as
+// centroids of their own; when a bin is full its centroids are sorted and neighbours
+// are combined as long as the cluster stays within one unit of the t-digest scale
+// function k(q) = delta / (2 pi) asin(2q - 1), which keeps the clusters small in the
+// tails and larger around the median. Two sketches of disjoint inputs are merged by
+// appending the centroids of one to the other, so groups and partial outputs combine
+// like the BinAccumulator moments.
+//
+// All centroids live in one arena allocated up front, Capacity() slots per bin, so the
+// memory is fixed at 8 bytes x Capacity() per bin however many values are folded in.
+// Centroids are stored as float: the quantiles are estimates to begin with.
+class BinQuantiles {
+public:
+    static constexpr std::size_t kDefaultCapacity = 64;
+
+    BinQuantiles() = default;
+    explicit BinQuantiles(std::size_t nBins, std::size_t capacity = kDefaultCapacity)
+        : fCapacity(capacity), fMean(nBins * capacity, 0.0f), fWeight(nBins * capacity, 0.0f), fCount(nBins, 0) {}
+
+    std::size_t Size() const { return fCount.size(); }
+    std::size_t Capacity() const { return fCapacity; }
+
+    // Fold value x with weight w into one bin
+    void Fill(std::size_t bin, double x, double w = 1.0) {
+        if (w <= 0.0) return;
+        if (fCount[bin] == fCapacity) Compress(bin);
+        std::size_t slot = bin * fCapacity + fCount[bin]++;
+        fMean[slot] = (float)x;
+        fWeight[slot] = (float)w;
+    }
+
+    // Fold a whole bin array (one input) with a common weight w
+    template <typename T>
+    void FillArray(const T* values, double w = 1.0) {
+        for (std::size_t bin = 0; bin < Size(); ++bin) Fill(bin, values[bin], w);
+    }
+
+    // Combine a sketch filled from other inputs into this one.
+    // Returns false, leaving this sketch untouched, if the numbers of bins differ.
+    bool Merge(const BinQuantiles& other) {
+        if (other.Size() != Size()) return false;
+        for (std::size_t bin = 0; bin < Size(); ++bin) {
+            std::size_t first = bin * other.fCapacity;
+            for (std::size_t c = 0; c < other.fCount[bin]; ++c) {
+                Fill(bin, other.fMean[first + c], other.fWeight[first + c]);
+            }
+        }
+        return true;
+    }
+
+    // Estimated quantiles qs[k] (0 to 1) of the values of one bin, 0 for an empty bin.
+    // Interpolates linearly between the centres of the centroids, which are sorted once
+    // for all levels.
+    void Quantiles(std::size_t bin, const double* qs, std::size_t nLevels, double* result) const {
+        std::vector<Centroid> centroids = Sorted(bin);
+        double total = 0.0;
+        for (const auto& c : centroids) total += c.weight;
+        for (std::size_t k = 0; k < nLevels; ++k) result[k] = Interpolate(centroids, qs[k] * total);
+    }
+
+    double Quantile(std::size_t bin, double q) const {
+        double result;
+        Quantiles(bin, &q, 1, &result);
+        return result;
+    }
+
+    // Raw arena, Capacity() slots per bin of which Count(bin) are used, e.g. for
+    // persistence; call Recount() after filling it directly
+    float* GetMeanArray() { return fMean.data(); }
+    float* GetWeightArray() { return fWeight.data(); }
+    const float* GetMeanArray() const { return fMean.data(); }
+    const float* GetWeightArray() const { return fWeight.data(); }
+    std::size_t Count(std::size_t bin) const { return fCount[bin]; }
+
+    // Take the used slots of each bin to be the leading ones of positive weight
+    void Recount() {
+        for (std::size_t bin = 0; bin < Size(); ++bin) {
+            std::size_t n = 0;
+            while (n < fCapacity && fWeight[bin * fCapacity + n] > 0.0f) ++n;
+            fCount[bin] = n;
+        }
+    }
+
+private:
+    struct Centroid {
+        float mean;
+        float weight;
+    };
+
+    std::vector<Centroid> Sorted(std::size_t bin) const {
+        std::vector<Centroid> centroids(fCount[bin]);
+        std::size_t first = bin * fCapacity;
+        for (std::size_t c = 0; c < centroids.size(); ++c) centroids[c] = {fMean[first + c], fWeight[first + c]};
+        std::sort(centroids.begin(), centroids.end(), [](const Centroid& a, const Centroid& b) { return a.mean < b.mean; });
+        return centroids;
+    }
+
+    // Value below which a weight of target lies, from centroids sorted by mean
+    static double Interpolate(const std::vector<Centroid>& centroids, double target) {
+        if (centroids.empty()) return 0.0;
+        double before = 0.0; // Weight below the current centroid
+        for (std::size_t c = 0; c < centroids.size(); ++c) {
+            double centre = before + 0.5 * centroids[c].weight;
+            if (target <= centre) {
+                if (c == 0) return centroids[0].mean;
+                double previousCentre = before - 0.5 * centroids[c - 1].weight;
+                double t = (target - previousCentre) / (centre - previousCentre);
+                return centroids[c - 1].mean + t * (centroids[c].mean - centroids[c - 1].mean);
+            }
+            before += centroids[c].weight;
+        }
+        return centroids.back().mean;
+    }
+
+    // Scale function of the t-digest with compression delta
+    static double Scale(double q, double delta) {
+        const double kPi = 3.14159265358979323846;
+        return delta / (2.0 * kPi) * std::asin(2.0 * std::min(1.0, std::max(0.0, q)) - 1.0);
+    }
+
+    // Combine the centroids of a full bin, which leaves about two thirds of its slots used
+    void Compress(std::size_t bin) {
+        std::vector<Centroid> centroids = Sorted(bin);
+        double total = 0.0;
+        for (const auto& c : centroids) total += c.weight;
+        const double delta = fCapacity;
+
+        std::vector<Centroid> merged;
+        double before = 0.0; // Weight below the cluster being built
+        for (const auto& c : centroids) {
+            if (!merged.empty()) {
+                Centroid& last = merged.back();
+                double sum = (double)last.weight + c.weight;
+                if (Scale((before + sum) / total, delta) - Scale(before / total, delta) <= 1.0) {
+                    last.mean = (float)(last.mean + (c.mean - last.mean) * (c.weight / sum));
+                    last.weight = (float)sum;
+                    continue;
+                }
+                before += last.weight;
+            }
+            merged.push_back(c);
+        }
+        // The scale function bounds the clusters well below the capacity; make room
+        // in any case by combining the lightest neighbours
+        while (merged.size() >= fCapacity) {
+            std::size_t lightest = 0;
+            for (std::size_t c = 1; c + 1 < merged.size(); ++c) {
+                if (merged[c].weight + merged[c + 1].weight < merged[lightest].weight + merged[lightest + 1].weight) lightest = c;
+            }
+            Centroid& a = merged[lightest];
+            const Centroid& b = merged[lightest + 1];
+            double sum = (double)a.weight + b.weight;
+            a.mean = (float)(a.mean + (b.mean - a.mean) * (b.weight / sum));
+            a.weight = (float)sum;
+            merged.erase(merged.begin() + lightest + 1);
+        }
+
+        std::size_t first = bin * fCapacity;
+        std::fill(fWeight.begin() + first, fWeight.begin() + first + fCapacity, 0.0f);
+        for (std::size_t c = 0; c < merged.size(); ++c) {
+            fMean[first + c] = merged[c].mean;
+            fWeight[first + c] = merged[c].weight;
+        }
+        fCount[bin] = merged.size();
+    }
+
+    std::size_t fCapacity = kDefaultCapacity;
+    std::vector<float> fMean;         // Centroid means, Capacity() slots per bin
+    std::vector<float> fWeight;       // Centroid weights, 0 in unused slots
+    std::vector<std::size_t> fCount;  // Used slots of each bin
+};
+
+#endif // BIN_QUANTILES_H
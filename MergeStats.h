@@ -0,0 +1,246 @@
+#ifndef MERGE_STATS_H
+#define MERGE_STATS_H
+
+#include <chrono>
+#include <cmath>   // For std::isfinite
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/resource.h> // For getrusage
+
+// Timers and counters of one merge, written out as a JSON report.
+//
+// Phases are timed by wall clock on the thread driving the merge. Work done per object
+// on the worker threads (reading, reducing bins, writing) is summed over all threads as
+// task time, so it can exceed the wall time of the phase it belongs to. All methods may
+// be called from several threads at once.
+class MergeStats {
+public:
+    // Time spent on one object, for the optional per-object breakdown
+    struct ObjectRecord {
+        std::string path;
+        std::string className;
+        double readSeconds = 0.0;
+        double reduceSeconds = 0.0;
+        double writeSeconds = 0.0;
+        long long bytesRead = 0;    // Compressed size of the keys read
+        long long bytesWritten = 0; // Bytes written for the merged object
+    };
+
+    // Adds the wall time from its construction to Stop() or its destruction to a phase
+    class PhaseTimer {
+    public:
+        PhaseTimer(MergeStats& stats, std::string phase)
+            : fStats(stats), fPhase(std::move(phase)), fStart(std::chrono::steady_clock::now()) {}
+        ~PhaseTimer() { Stop(); }
+        PhaseTimer(const PhaseTimer&) = delete;
+        PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+        void Stop() {
+            if (fStopped) return;
+            fStats.AddPhase(fPhase, Seconds(fStart));
+            fStopped = true;
+        }
+
+    private:
+        MergeStats& fStats;
+        std::string fPhase;
+        std::chrono::steady_clock::time_point fStart;
+        bool fStopped = false;
+    };
+
+    // Seconds elapsed since start
+    static double Seconds(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Peak resident set size of this process in MB (kB from getrusage on Linux)
+    static double PeakRssMB() {
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0) return 0.0;
+        return usage.ru_maxrss / 1024.0;
+    }
+
+    using Timings = std::vector<std::pair<std::string, double>>; // Seconds by name, in order of first use
+
+    void SetRecordObjects(bool record) { fRecordObjects = record; }
+    bool RecordObjects() const { return fRecordObjects; }
+
+    void AddPhase(const std::string& phase, double seconds) {
+        std::lock_guard<std::mutex> lock(fMutex);
+        Add(fPhases, phase, seconds);
+    }
+    void AddBytesRead(long long n) {
+        std::lock_guard<std::mutex> lock(fMutex);
+        fBytesRead += n;
+    }
+    void AddBytesWritten(long long n) {
+        std::lock_guard<std::mutex> lock(fMutex);
+        fBytesWritten += n;
+    }
+    void CountObjects(const std::string& className, long long n) {
+        std::lock_guard<std::mutex> lock(fMutex);
+        fObjectsPerClass[className] += n;
+    }
+    void SetOutputCompression(const std::string& name) {
+        std::lock_guard<std::mutex> lock(fMutex);
+        fOutputCompression = name;
+    }
+
+    // Count one object (or tree) written: its size before and after compression and
+    // the time it took. For trees the time covers the whole copy.
+    void AddCompression(const std::string& className, long long rawBytes, long long zipBytes, double seconds) {
+        std::lock_guard<std::mutex> lock(fMutex);
+        Compression& c = fCompression[className];
+        c.rawBytes += rawBytes;
+        c.zipBytes += zipBytes;
+        c.seconds += seconds;
+    }
+
+    void CountFiles(long long opened, long long failed) {
+        std::lock_guard<std::mutex> lock(fMutex);
+        fFilesOpened += opened;
+        fFilesFailed += failed;
+    }
+
+    // Add the task times of one object, and its record if the breakdown is requested
+    void AddObject(const ObjectRecord& record) {
+        std::lock_guard<std::mutex> lock(fMutex);
+        Add(fTasks, "read objects", record.readSeconds);
+        Add(fTasks, "reduce bins", record.reduceSeconds);
+        Add(fTasks, "write objects", record.writeSeconds);
+        if (fRecordObjects) fObjects.push_back(record);
+    }
+
+    // Write the report; returns false if the file cannot be written
+    bool WriteJson(const std::string& fileName, double totalSeconds) const {
+        std::lock_guard<std::mutex> lock(fMutex);
+        std::ofstream out(fileName);
+        if (!out) return false;
+        out << "{\n";
+        out << "  \"wall_seconds\": " << Number(totalSeconds) << ",\n";
+        out << "  \"peak_rss_mb\": " << Number(PeakRssMB()) << ",\n";
+        out << "  \"files_opened\": " << fFilesOpened << ",\n";
+        out << "  \"files_failed\": " << fFilesFailed << ",\n";
+        out << "  \"bytes_read\": " << fBytesRead << ",\n";
+        out << "  \"bytes_written\": " << fBytesWritten << ",\n";
+        WriteSeconds(out, "phase_seconds", fPhases);
+        out << ",\n";
+        WriteSeconds(out, "task_seconds", fTasks);
+        out << ",\n";
+        out << "  \"objects_per_class\": {";
+        const char* sep = "\n";
+        for (const auto& count : fObjectsPerClass) {
+            out << sep << "    " << Quote(count.first) << ": " << count.second;
+            sep = ",\n";
+        }
+        out << (fObjectsPerClass.empty() ? "}" : "\n  }");
+        out << ",\n  \"output_compression\": " << Quote(fOutputCompression);
+        out << ",\n  \"compression_per_class\": {";
+        sep = "\n";
+        for (const auto& c : fCompression) {
+            const Compression& comp = c.second;
+            out << sep << "    " << Quote(c.first) << ": {\"raw_bytes\": " << comp.rawBytes
+                << ", \"compressed_bytes\": " << comp.zipBytes
+                << ", \"ratio\": " << Number(comp.zipBytes > 0 ? double(comp.rawBytes) / comp.zipBytes : 0.0)
+                << ", \"seconds\": " << Number(comp.seconds)
+                << ", \"raw_mb_per_s\": " << Number(comp.seconds > 0 ? comp.rawBytes / 1e6 / comp.seconds : 0.0) << "}";
+            sep = ",\n";
+        }
+        out << (fCompression.empty() ? "}" : "\n  }");
+        if (fRecordObjects) {
+            out << ",\n  \"objects\": [";
+            sep = "\n";
+            for (const auto& obj : fObjects) {
+                out << sep << "    {\"path\": " << Quote(obj.path) << ", \"class\": " << Quote(obj.className)
+                    << ", \"read_seconds\": " << Number(obj.readSeconds) << ", \"reduce_seconds\": " << Number(obj.reduceSeconds)
+                    << ", \"write_seconds\": " << Number(obj.writeSeconds) << ", \"bytes_read\": " << obj.bytesRead
+                    << ", \"bytes_written\": " << obj.bytesWritten << "}";
+                sep = ",\n";
+            }
+            out << (fObjects.empty() ? "]" : "\n  ]");
+        }
+        out << "\n}\n";
+        return bool(out);
+    }
+
+    // Wall time of the phases so far
+    Timings PhaseTimings() const {
+        std::lock_guard<std::mutex> lock(fMutex);
+        return fPhases;
+    }
+
+private:
+    // Output size of one class before and after compression
+    struct Compression {
+        long long rawBytes = 0;
+        long long zipBytes = 0;
+        double seconds = 0.0;
+    };
+
+    static void Add(Timings& timings, const std::string& name, double seconds) {
+        for (auto& t : timings) {
+            if (t.first == name) {
+                t.second += seconds;
+                return;
+            }
+        }
+        timings.emplace_back(name, seconds);
+    }
+
+    static void WriteSeconds(std::ostream& out, const char* key, const Timings& timings) {
+        out << "  \"" << key << "\": {";
+        const char* sep = "\n";
+        for (const auto& t : timings) {
+            out << sep << "    " << Quote(t.first) << ": " << Number(t.second);
+            sep = ",\n";
+        }
+        out << (timings.empty() ? "}" : "\n  }");
+    }
+
+    // JSON number, or null for NaN and infinities, which JSON cannot hold
+    static std::string Number(double value) {
+        if (!std::isfinite(value)) return "null";
+        std::ostringstream out;
+        out << value;
+        return out.str();
+    }
+
+    // JSON string literal
+    static std::string Quote(const std::string& text) {
+        std::string quoted = "\"";
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                quoted += '\\';
+                quoted += c;
+            } else if ((unsigned char)c < 0x20) {
+                const char* hex = "0123456789abcdef";
+                quoted += "\\u00";
+                quoted += hex[(c >> 4) & 0xf];
+                quoted += hex[c & 0xf];
+            } else {
+                quoted += c;
+            }
+        }
+        return quoted + "\"";
+    }
+
+    mutable std::mutex fMutex;
+    bool fRecordObjects = false;
+    Timings fPhases;              // Wall time of the phases of the merge
+    Timings fTasks;               // Time of the per-object work, summed over threads
+    std::map<std::string, long long> fObjectsPerClass; // Objects found in the inputs
+    std::vector<ObjectRecord> fObjects;
+    std::string fOutputCompression;
+    std::map<std::string, Compression> fCompression; // Objects written, by class
+    long long fBytesRead = 0;
+    long long fBytesWritten = 0;
+    long long fFilesOpened = 0;
+    long long fFilesFailed = 0;
+};
+
+#endif // MERGE_STATS_H
@@ -0,0 +1,2781 @@
+#include "PairGenMerger.h"
+#include "BinAccumulator.h"
+#include "BinQuantiles.h"
+#include "BinBootstrap.h"
+#include "BinJackknife.h"
+#include "BinCovariance.h"
+#include "ReplicaScore.h"
+#include "MergeStats.h"
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <filesystem> // For scanning directories
+#include <cmath>      // For std::sqrt
+#include <algorithm>  // For std::copy
+#include <sstream>    // For parsing the option string
+#include <future>     // For reading inputs in the background
+#include <deque>
+#include <set>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+#include <thread>     // For std::thread::hardware_concurrency
+#include <atomic>
+#include <cctype>     // For std::isdigit
+#include <cstring>    // For std::memcpy
+#include <cstdio>     // For std::snprintf
+#include <fstream>    // For input lists and hashing the ratio list
+#include <iterator>
+#include <tuple>      // For the table of parameter types
+#include <fnmatch.h>  // For matching the input pattern
+#include <TFile.h>
+#include <TKey.h>
+#include <TH1.h>
+#include <TH2.h>
+#include <TH3.h>
+#include <TROOT.h>
+#include <TParameter.h>
+#include <TTree.h>
+#include <TBranch.h>
+#include <Compression.h>
+#include <TClass.h>
+#include <TVectorD.h>
+#include <TMatrixDSym.h>
+#include <TMatrixDSparse.h>
+#include <TObjString.h>
+#include <ROOT/TThreadExecutor.hxx>
+#include <ROOT/TSeq.hxx>
+#include <ROOT/TProcessExecutor.hxx>
+
+namespace fs = std::filesystem; // Alias for easier usage
+
+// Function to display a progress bar
+void PrintProgressBar(int current, int total) {
+    int barWidth = 70;
+    float progress = float(current) / float(total);
+    std::cout << "[";
+    int pos = barWidth * progress;
+    for (int i = 0; i < barWidth; ++i) {
+        if (i < pos) std::cout << "=";
+        else if (i == pos) std::cout << ">";
+        else std::cout << " ";
+    }
+    std::cout << "] " << int(progress * 100.0) << " %\r";
+    std::cout.flush();
+}
+
+// Usage text of the merge options
+const char* MergeUsage() {
+    return "Usage: pairgen-merge [options]\n"
+           "Merge PairGen replica files: histograms get the mean over the replicas as bin content\n"
+           "and their spread as bin error, parameters are combined by their merge mode (sum, product,\n"
+           "maximum, minimum, first or last value; constant ones keep theirs) and trees are chained.\n"
+           "\n"
+           "  --input-pattern P   Glob of the input files, \"**\" for any depth of directories (default \"*/PairGen.root\")\n"
+           "  --input-name N      Merge the files named N at any depth, same as --input-pattern \"**/N\"\n"
+           "  --inputs L          Merge the files of the list L instead (text: \"file [weight] [label]\" per line,\n"
+           "                      or JSON: [{\"file\": ..., \"weight\": ..., \"label\": ...}, ...])\n"
+           "  --open-threads N    Threads scanning directories and checking the inputs (default 16)\n"
+           "  --force             Merge even if the output already records the same inputs and settings\n"
+           "  --output F          Output file (default \"PairGenMerged.root\")\n"
+           "  --threads N         Merge histograms and parameters on N threads, 0 for all cores (default 1)\n"
+           "  --policy P          Bin error: spread (default), sample or mean-error\n"
+           "  --quantiles L       Also write per-bin quantiles of the replicas at the percent levels L,\n"
+           "                      e.g. 16,50,84, as histograms <name>_q16, ... next to each histogram\n"
+           "  --bootstrap B       Also write bootstrap percentile bands of the bin means from B Poisson\n"
+           "                      resamples of the replicas, as histograms <name>_boot2.5, ...\n"
+           "  --bootstrap-levels L  Percent levels of the bootstrap bands (default 2.5,97.5)\n"
+           "  --bootstrap-seed S  Seed of the bootstrap resamples (default 0)\n"
+           "  --jackknife         Also write the delete-one jackknife variance of the bin means, <name>_jkvar\n"
+           "  --jackknife-ratios C  Write the ratios listed in C (\"name numerator denominator\" per line,\n"
+           "                      histogram paths) with delete-one jackknife errors\n"
+           "  --covariance P      Write the bin-to-bin covariance (<name>_cov, TMatrixDSym) and correlation\n"
+           "                      (<name>_corr, TH2D) of the histograms whose paths match the globs P (comma separated)\n"
+           "  --covariance-band K Only keep covariances of bins at most K apart (default 0: all), written as\n"
+           "                      a TMatrixDSparse and a correlation over the bin and the offset of the other\n"
+           "  --outliers T        Score every replica against the others as it is merged, with a chi2 per bin\n"
+           "                      of its histograms, and leave out those above T (streams through the inputs,\n"
+           "                      with --max-open 16 unless given)\n"
+           "  --outlier-action A  What happens to an outlier: exclude (default) or downweight (by T / score)\n"
+           "  --outlier-warmup K  Replicas compared with each other before there is a running mean (default 8,\n"
+           "                      at least 3)\n"
+           "  --compression C     Output compression: fast-write (LZ4:1), balanced (ZSTD:5), archive (ZSTD:9),\n"
+           "                      none, or zlib, lzma, lz4, zstd with an optional level 1-9, e.g. zstd:7\n"
+           "  --max-open K        Stream through the inputs with at most K files open at a time\n"
+           "  --memory-budget M   With --max-open: merge the histograms in passes that fit in about M MB\n"
+           "  --keep-state        Store the per-bin merge state, so the output can be merged further\n"
+           "  --incremental       Only add the inputs an existing output does not list (implies --keep-state)\n"
+           "  --groups G          Merge G groups of inputs in separate processes and combine them\n"
+           "  --group-index g     Only merge group g into its partial file\n"
+           "  --reduce            Combine the partial files of earlier --group-index runs\n"
+           "  --report F          Write timers and counters of the merge to the JSON file F\n"
+           "  --report-objects    Add the time and bytes of every merged object to the report\n"
+           "  -h, --help          Show this help\n";
+}
+
+// Compression settings for a preset, "none", or "algorithm[:level]"
+bool ParseCompression(const std::string& spec, int& settings) {
+    using Algorithm = ROOT::RCompressionSetting::EAlgorithm;
+    if (spec == "fast-write") return ParseCompression("lz4:1", settings);
+    if (spec == "balanced") return ParseCompression("zstd:5", settings);
+    if (spec == "archive") return ParseCompression("zstd:9", settings);
+    if (spec == "none") {
+        settings = 0;
+        return true;
+    }
+
+    std::string name = spec.substr(0, spec.find(':'));
+    int level = 5;
+    if (name.size() < spec.size()) {
+        std::string levelText = spec.substr(name.size() + 1);
+        if (levelText.size() != 1 || levelText[0] < '1' || levelText[0] > '9') return false;
+        level = levelText[0] - '0';
+    }
+    Algorithm::EValues algorithm;
+    if (name == "zlib") {
+        algorithm = Algorithm::kZLIB;
+    } else if (name == "lzma") {
+        algorithm = Algorithm::kLZMA;
+    } else if (name == "lz4") {
+        algorithm = Algorithm::kLZ4;
+    } else if (name == "zstd") {
+        algorithm = Algorithm::kZSTD;
+    } else {
+        return false;
+    }
+    settings = ROOT::CompressionSettings(algorithm, level);
+    return true;
+}
+
+// Readable form of compression settings, e.g. "ZSTD:5"
+std::string CompressionName(int settings) {
+    if (settings < 0) return "default";
+    if (settings % 100 == 0) return "none";
+    static const char* const names[] = {"global", "ZLIB", "LZMA", "old", "LZ4", "ZSTD"};
+    int algorithm = settings / 100;
+    std::string name = algorithm < 6 ? names[algorithm] : "algorithm " + std::to_string(algorithm);
+    return name + ":" + std::to_string(settings % 100);
+}
+
+// Parse a comma separated list of percent levels such as "16,50,84", each between 0 and 100
+bool ParsePercentLevels(const std::string& text, std::vector<double>& levels) {
+    levels.clear();
+    std::istringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        std::istringstream number(item);
+        double level;
+        if (!(number >> level) || !number.eof() || level < 0.0 || level > 100.0) return false;
+        levels.push_back(level);
+    }
+    return !levels.empty();
+}
+
+// Parse command-line style arguments into opts; false on unknown or incomplete options
+bool ParseMergeOptions(const std::vector<std::string>& args, MergeOptions& opts) {
+    bool ok = true;
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& flag = args[i];
+
+        // Read the value following the flag into out
+        auto value = [&](std::string& out) {
+            if (i + 1 >= args.size()) {
+                std::cerr << "Option " << flag << " needs a value" << std::endl;
+                ok = false;
+                return false;
+            }
+            out = args[++i];
+            return true;
+        };
+        auto number = [&](auto& out) {
+            std::string text;
+            if (!value(text)) return;
+            std::istringstream in(text);
+            if (text.empty() || text[0] == '-' || !(in >> out) || !in.eof()) {
+                std::cerr << "Option " << flag << " needs a non-negative number, got " << text << std::endl;
+                ok = false;
+            }
+        };
+
+        if (flag == "--input-pattern") {
+            value(opts.inputPattern);
+        } else if (flag == "--input-name") {
+            std::string name;
+            if (value(name)) opts.inputPattern = "**/" + name;
+        } else if (flag == "--inputs") {
+            value(opts.inputListFileName);
+        } else if (flag == "--force") {
+            opts.force = true;
+        } else if (flag == "--open-threads") {
+            number(opts.nOpenThreads);
+        } else if (flag == "--output") {
+            value(opts.outputFileName);
+        } else if (flag == "--threads") {
+            number(opts.nThreads);
+        } else if (flag == "--policy") {
+            std::string policy;
+            if (!value(policy)) continue;
+            if (policy == "spread") {
+                opts.errorPolicy = ErrorPolicy::kSpread;
+            } else if (policy == "sample") {
+                opts.errorPolicy = ErrorPolicy::kSample;
+            } else if (policy == "mean-error") {
+                opts.errorPolicy = ErrorPolicy::kErrorOfMean;
+            } else {
+                std::cerr << "Unknown merge policy " << policy << std::endl;
+                ok = false;
+            }
+        } else if (flag == "--quantiles") {
+            std::string levels;
+            if (value(levels) && !ParsePercentLevels(levels, opts.quantiles)) {
+                std::cerr << "Option --quantiles needs percent levels such as 16,50,84, got " << levels << std::endl;
+                ok = false;
+            }
+        } else if (flag == "--bootstrap") {
+            number(opts.bootstrap);
+        } else if (flag == "--bootstrap-levels") {
+            std::string levels;
+            if (value(levels) && !ParsePercentLevels(levels, opts.bootstrapLevels)) {
+                std::cerr << "Option --bootstrap-levels needs percent levels such as 2.5,97.5, got " << levels << std::endl;
+                ok = false;
+            }
+        } else if (flag == "--bootstrap-seed") {
+            number(opts.bootstrapSeed);
+        } else if (flag == "--jackknife") {
+            opts.jackknife = true;
+        } else if (flag == "--jackknife-ratios") {
+            value(opts.jackknifeRatioFileName);
+        } else if (flag == "--covariance") {
+            std::string patterns, pattern;
+            if (!value(patterns)) continue;
+            std::istringstream in(patterns);
+            while (std::getline(in, pattern, ',')) {
+                if (!pattern.empty()) opts.covariancePatterns.push_back(pattern);
+            }
+        } else if (flag == "--covariance-band") {
+            number(opts.covarianceBand);
+        } else if (flag == "--outliers") {
+            number(opts.outlierThreshold);
+        } else if (flag == "--outlier-action") {
+            std::string action;
+            if (!value(action)) continue;
+            if (action == "exclude" || action == "downweight") {
+                opts.outlierDownweight = action == "downweight";
+            } else {
+                std::cerr << "Unknown outlier action " << action << std::endl;
+                ok = false;
+            }
+        } else if (flag == "--outlier-warmup") {
+            number(opts.outlierWarmup);
+        } else if (flag == "--compression") {
+            std::string spec;
+            if (value(spec) && !ParseCompression(spec, opts.compression)) {
+                std::cerr << "Unknown compression " << spec << std::endl;
+                ok = false;
+            }
+        } else if (flag == "--max-open") {
+            number(opts.maxOpen);
+        } else if (flag == "--memory-budget") {
+            number(opts.memoryBudgetMB);
+        } else if (flag == "--keep-state") {
+            opts.keepState = true;
+        } else if (flag == "--groups") {
+            number(opts.nGroups);
+        } else if (flag == "--group-index") {
+            number(opts.groupIndex);
+        } else if (flag == "--reduce") {
+            opts.reduce = true;
+        } else if (flag == "--incremental") {
+            opts.incremental = true;
+            opts.keepState = true; // So that the next run can be incremental too
+        } else if (flag == "--report") {
+            value(opts.reportFileName);
+        } else if (flag == "--report-objects") {
+            opts.reportObjects = true;
+        } else {
+            std::cerr << "Unknown merge option " << flag << std::endl;
+            ok = false;
+        }
+    }
+    if (opts.outlierThreshold > 0.0 && opts.maxOpen == 0) {
+        if (std::find(args.begin(), args.end(), "--max-open") != args.end()) {
+            std::cerr << "Option --outliers streams through the inputs and needs --max-open above 0" << std::endl;
+            ok = false;
+        } else {
+            opts.maxOpen = 16;
+        }
+    }
+    if (opts.groupIndex >= 0 && opts.groupIndex >= (int)opts.nGroups) {
+        std::cerr << "Option --group-index must be below the number of --groups" << std::endl;
+        ok = false;
+    }
+    return ok;
+}
+
+// Parse an option string such as "--threads 8 --max-open 64" into opts
+bool ParseMergeOptions(const std::string& text, MergeOptions& opts) {
+    std::istringstream in(text);
+    std::vector<std::string> args;
+    std::string arg;
+    while (in >> arg) args.push_back(arg);
+    return ParseMergeOptions(args, opts);
+}
+
+// Directory of a merged output holding the per-bin state (weight, mean, M2) of every
+// histogram, written with --keep-state. An output carrying it can be an input of a later
+// merge, where its state is combined exactly instead of counting as one more replica.
+// The state directory also holds the manifest: a TList of TObjString with the replica
+// files that went into the output.
+const char* const kMergeStateDir = "PairGenMergeState";
+const char* const kManifestName = "inputs";
+
+// Directory of every merged output recording what it was made from: a TList of
+// TObjString "name<TAB>size<TAB>mtime<TAB>weight<TAB>label", one per input
+// (kManifestName), and the merge settings as a TObjString (kSettingsName). A rerun with
+// the same record finds the output up to date and skips the merge. With --outliers it
+// also holds the scores of the replicas (kReplicaScoresName), a TObjString
+// "name<TAB>chi2/ndf<TAB>ndf<TAB>factor" per replica scored, where the factor scales its
+// weight: 1 if it was merged as it is, 0 if it was left out.
+const char* const kMergeInfoDir = "PairGenMergeInfo";
+const char* const kSettingsName = "settings";
+const char* const kReplicaScoresName = "replicas";
+
+// How an object of the inputs is merged
+enum class ObjectKind { kHistogram, kParameter, kTree, kDirectory, kOther };
+
+// One object of the key index: an object path found in at least one input, with the
+// class and cycle of its first occurrence and the inputs that hold it
+struct KeyEntry {
+    std::string dirPath;           // Directory inside the files, "" for the top level
+    std::string name;
+    std::string className;
+    ObjectKind kind;
+    short cycle = 0;
+    long long objLen = 0;          // Uncompressed size of the first key, for memory estimates
+    std::vector<char> present;     // Per input: whether it holds the object with the same class
+    std::vector<TKey*> keys;       // Per input: its key, kept when all inputs stay open
+    size_t nPresent = 0;
+
+    std::string Path() const { return dirPath.empty() ? name : dirPath + "/" + name; }
+};
+
+// Fold the value of one input's parameter into the running result, both of the same
+// TParameter<T> class. Returns false, leaving the result untouched, for a merge mode
+// it does not know.
+using ParameterFold = bool (*)(TObject* total, const TObject* input, const char* fileName);
+
+// Combine two values the way TParameter<T>::Merge() does for the merge mode of total:
+// '+' sum, '*' product, 'M' maximum, 'm' minimum, 'f' keep the first, 'l' keep the last.
+// For bool these are or, and, or, and. A parameter marked constant (kIsConst) keeps its
+// value; an input with another value is reported and the mark is dropped.
+template <typename T>
+bool FoldParameter(TObject* total, const TObject* input, const char* fileName) {
+    auto* result = static_cast<TParameter<T>*>(total);
+    T a = result->GetVal();
+    T b = static_cast<const TParameter<T>*>(input)->GetVal();
+    if (result->TestBit(TParameter<T>::kIsConst)) {
+        if (!(a == b)) {
+            std::cerr << "Constant parameter " << result->GetName() << " has another value in file " << fileName
+                      << ", the first one is kept" << std::endl;
+            result->ResetBit(TParameter<T>::kIsConst);
+        }
+        return true;
+    }
+    switch (result->GetMergeMode()) {
+        case '+': result->SetVal(T(a + b)); return true;
+        case '*': result->SetVal(T(a * b)); return true;
+        case 'M': result->SetVal(std::max(a, b)); return true;
+        case 'm': result->SetVal(std::min(a, b)); return true;
+        case 'f': return true;
+        case 'l': result->SetVal(b); return true;
+        default:  return false;
+    }
+}
+
+// Value types of the TParameter classes that are merged
+using ParameterTypes = std::tuple<Double_t, Float_t, Long64_t, Long_t, Int_t, Bool_t>;
+
+// Reduction for exactly the class cl among TParameter<T> of the types in the table, or
+// nullptr if cl is not one of them
+template <typename... Ts>
+ParameterFold FindParameterFold(const TClass* cl, std::tuple<Ts...>*) {
+    ParameterFold fold = nullptr;
+    ((cl == TParameter<Ts>::Class() ? (fold = &FoldParameter<Ts>, true) : false) || ...);
+    return fold;
+}
+
+ParameterFold FindParameterFold(const TClass* cl) {
+    return FindParameterFold(cl, (ParameterTypes*)nullptr);
+}
+
+// One histogram or parameter of the output, with its running merge state
+struct MergeItem {
+    ObjectKind kind;
+    size_t entry;                  // Index of the object in the key index
+    std::string dirPath;           // Directory inside the files, "" for the top level
+    std::string name;
+    TDirectory* outputDir;         // Where the merged object is written
+    TH1* histClone = nullptr;      // First input's histogram, emptied, receiving the merged one
+    BinAccumulator acc;            // Per-bin state of a histogram, allocated on first fold
+    bool withQuantiles = false;    // Whether the histogram also gets per-bin quantiles
+    BinQuantiles quantiles;        // Per-bin quantile sketch, allocated on first fold if wanted
+    unsigned nResamples = 0;       // Bootstrap resamples of the histogram, 0 for none
+    unsigned bootstrapSeed = 0;
+    BinBootstrap bootstrap;        // Per-resample sums, allocated on first fold if wanted
+    std::vector<size_t> ratios;    // Jackknife ratios the histogram is an operand of
+    BinJackknife replicas;         // Per-replica contents, kept if it is an operand of a ratio
+    bool withCovariance = false;   // Whether the histogram gets a bin-to-bin covariance
+    unsigned covarianceBand = 0;
+    BinCovariance covariance;      // Over the bins in range, allocated on first fold if wanted
+    ROOT::TThreadExecutor* pool = nullptr; // The merge's pool, spreading the covariance updates
+    TObject* paramTotal = nullptr; // Running result of a parameter, a copy of the first input's
+    ParameterFold foldParameter = nullptr; // Reduction for the parameter's value type
+    int nFound = 0;                // Inputs folded so far
+    MergeStats::ObjectRecord timing; // Time and bytes spent on the item
+
+    std::string Path() const { return dirPath.empty() ? name : dirPath + "/" + name; }
+};
+
+// Saved per-bin state of a histogram in a merged output: its moments and, if it was
+// merged with --quantiles, --bootstrap, --covariance or as a ratio operand, its quantile
+// sketch, bootstrap sums, covariance and replica contents
+struct HistogramState {
+    BinAccumulator acc;
+    BinQuantiles quantiles;
+    BinBootstrap bootstrap;
+    BinJackknife replicas;
+    BinCovariance covariance;
+};
+
+// A ratio of two merged histograms with jackknife errors, from --jackknife-ratios.
+// Each operand hands over its replica contents when it is finished; the second one to
+// finish writes the ratio.
+struct RatioJob {
+    std::string name;
+    std::string numeratorPath;
+    std::string denominatorPath;
+    BinJackknife numerator;
+    BinJackknife denominator;
+    TH1* shape = nullptr;      // Clone of the merged numerator, receiving the ratio
+    TDirectory* outputDir = nullptr;
+    int nReady = 0;            // Operands handed over
+};
+
+// Inputs, output and pending work of one merge.
+// A TFile must not be read from two threads at once, so every input has its own mutex;
+// all writes to the output file go through outputMutex.
+struct MergeContext {
+    MergeOptions options;
+    std::vector<std::string> inputNames;  // All inputs, in merge order
+    std::vector<std::unique_ptr<TFile>> inputFiles; // Opened inputs when not streaming
+    std::vector<bool> inputHasState;      // Whether each opened input carries a merge state
+    std::unique_ptr<TFile> outputFile;
+    std::vector<std::mutex> inputMutexes; // One per opened input
+    std::mutex outputMutex;
+    std::vector<KeyEntry> entries;        // Key index: union of the objects of all inputs, in order of discovery
+    std::unordered_map<std::string, size_t> entryIndex; // Object path to position in entries
+    // Worker threads, unless running serially. Declared before the items, whose
+    // covariances run their updates on it, so that it outlives them; every merge, also
+    // in a forked worker of MergeGroups, builds its own
+    std::unique_ptr<ROOT::TThreadExecutor> pool;
+    std::vector<MergeItem> items;         // Histograms and parameters of the key index
+    std::vector<std::string> manifest;    // Replica files merged so far, including those behind merged inputs
+    std::vector<RatioJob> ratios;         // Jackknife ratios of merged histograms
+    std::mutex ratioMutex;
+    std::vector<double> inputFactors;     // Per input: weight factor from the outlier detection
+    std::vector<std::string> replicaScores; // Scored replicas, in the form of kReplicaScoresName
+    size_t nReferenceReplicas = 0;        // Replicas merged so far that later ones are scored against
+    std::vector<size_t> deferredEntries;  // Trees and other objects written once the outliers are known
+    MergeStats* stats = nullptr;          // Timers and counters of the merge
+    std::atomic<int> nDone{0};            // Finished items or inputs, for the progress bar
+};
+
+// Function to create the output directories and merge the objects of the key index
+void MergeDirectories(MergeContext& ctx);
+
+// Function to write the trees and other objects of entries of the key index
+void WritePassThrough(MergeContext& ctx, const std::vector<size_t>& entries);
+
+// Key of the highest cycle of an object in directory dirPath of a file; nullptr if
+// either does not exist
+TKey* GetKeyFromDirectory(TFile* file, const std::string& dirPath, const std::string& name) {
+    TDirectory* dir = dirPath.empty() ? file : file->GetDirectory(dirPath.c_str());
+    return dir ? dir->GetKey(name.c_str()) : nullptr;
+}
+
+// Read an object through its key in opened input file i while holding that file's lock.
+// The caller owns the object; histograms are detached from the input directory.
+TObject* ReadFromInput(MergeContext& ctx, size_t i, TKey* key) {
+    std::lock_guard<std::mutex> lock(ctx.inputMutexes[i]);
+    TObject* obj = key->ReadObj();
+    if (obj && obj->InheritsFrom(TH1::Class())) ((TH1*)obj)->SetDirectory(nullptr);
+    return obj;
+}
+
+// Write an object into a directory of the output file, one thread at a time, and count
+// its size before and after compression. Objects without a name of their own, such as
+// matrices, are given one. Returns the number of bytes written.
+int WriteOutput(MergeContext& ctx, TDirectory* outputDir, const TObject* obj, const char* name = nullptr) {
+    std::lock_guard<std::mutex> lock(ctx.outputMutex);
+    auto start = std::chrono::steady_clock::now();
+    int nBytes = outputDir->WriteTObject(obj, name);
+    double seconds = MergeStats::Seconds(start);
+    if (TKey* key = outputDir->GetKey(name ? name : obj->GetName())) {
+        ctx.stats->AddCompression(obj->ClassName(), key->GetObjlen(), key->GetNbytes() - key->GetKeylen(), seconds);
+    }
+    return nBytes;
+}
+
+// Directory below kMergeStateDir holding the state of the histograms of dirPath
+std::string StatePath(const std::string& dirPath) {
+    return dirPath.empty() ? kMergeStateDir : std::string(kMergeStateDir) + "/" + dirPath;
+}
+
+// Write the state of a histogram item as TVectorD next to each other in the state
+// directory: three for the accumulator, two with the centroid arena of the quantile
+// sketch, two with the sums of the bootstrap resamples, two with the replica contents
+// (their names in a TObjString) and three with the covariance, if it has them: its
+// weight and band, the bin means and the packed co-moments
+void WriteHistogramState(MergeContext& ctx, MergeItem& item) {
+    const BinAccumulator& acc = item.acc;
+    int nCells = acc.Size();
+    TVectorD weight(nCells, acc.GetWeightArray());
+    TVectorD mean(nCells, acc.GetMeanArray());
+    TVectorD m2(nCells, acc.GetM2Array());
+    int nSlots = item.quantiles.Size() * item.quantiles.Capacity();
+    TVectorD quantileMean(nSlots);
+    TVectorD quantileWeight(nSlots);
+    for (int slot = 0; slot < nSlots; ++slot) {
+        quantileMean[slot] = item.quantiles.GetMeanArray()[slot];
+        quantileWeight[slot] = item.quantiles.GetWeightArray()[slot];
+    }
+    int nResamples = item.bootstrap.Resamples();
+    TVectorD bootstrapSum(nResamples * nCells, item.bootstrap.GetSumArray());
+    TVectorD bootstrapWeight(nResamples, item.bootstrap.GetWeightArray());
+    const BinJackknife& replicas = item.replicas;
+    int nReplicas = replicas.Replicas();
+    TVectorD replicaValues(replicas.Values().size());
+    std::copy(replicas.Values().begin(), replicas.Values().end(), replicaValues.GetMatrixArray());
+    TVectorD replicaWeights(nReplicas, replicas.Weights().data());
+    std::string replicaKeys;
+    for (const auto& key : replicas.Keys()) replicaKeys += key + "\n";
+    TObjString replicaNames(replicaKeys.c_str());
+    BinCovariance& covariance = item.covariance;
+    covariance.Flush();
+    TVectorD covarianceInfo(2);
+    covarianceInfo[0] = covariance.Weight();
+    covarianceInfo[1] = covariance.Band();
+    TVectorD covarianceMean(covariance.Size(), covariance.GetMeanArray());
+    TVectorD covarianceM2(covariance.ComomentSize(), covariance.GetComomentArray());
+
+    std::lock_guard<std::mutex> lock(ctx.outputMutex);
+    TDirectory* stateDir = ctx.outputFile->mkdir(StatePath(item.dirPath).c_str(), "", true);
+    stateDir->WriteTObject(&weight, (item.name + "_weight").c_str());
+    stateDir->WriteTObject(&mean, (item.name + "_mean").c_str());
+    stateDir->WriteTObject(&m2, (item.name + "_m2").c_str());
+    if (nSlots > 0) {
+        stateDir->WriteTObject(&quantileMean, (item.name + "_qmean").c_str());
+        stateDir->WriteTObject(&quantileWeight, (item.name + "_qweight").c_str());
+    }
+    if (nResamples > 0) {
+        stateDir->WriteTObject(&bootstrapSum, (item.name + "_bsum").c_str());
+        stateDir->WriteTObject(&bootstrapWeight, (item.name + "_bweight").c_str());
+    }
+    if (nReplicas > 0) {
+        stateDir->WriteTObject(&replicaValues, (item.name + "_jkvalues").c_str());
+        stateDir->WriteTObject(&replicaWeights, (item.name + "_jkweights").c_str());
+        stateDir->WriteTObject(&replicaNames, (item.name + "_jkreplicas").c_str());
+    }
+    if (covariance.Size() > 0) {
+        stateDir->WriteTObject(&covarianceInfo, (item.name + "_covinfo").c_str());
+        stateDir->WriteTObject(&covarianceMean, (item.name + "_covmean").c_str());
+        stateDir->WriteTObject(&covarianceM2, (item.name + "_covm2").c_str());
+    }
+}
+
+// Read the state of a histogram from a file written with --keep-state. The quantile
+// sketch, the bootstrap, the replicas and the covariance are left empty if the file has
+// none. Returns false if the file holds no complete accumulator for it.
+bool ReadHistogramState(TFile* file, const std::string& dirPath, const std::string& name, HistogramState& state) {
+    TDirectory* stateDir = file->GetDirectory(StatePath(dirPath).c_str());
+    if (!stateDir) return false;
+    std::unique_ptr<TVectorD> weight((TVectorD*)stateDir->Get((name + "_weight").c_str()));
+    std::unique_ptr<TVectorD> mean((TVectorD*)stateDir->Get((name + "_mean").c_str()));
+    std::unique_ptr<TVectorD> m2((TVectorD*)stateDir->Get((name + "_m2").c_str()));
+    if (!weight || !mean || !m2) return false;
+    int nCells = weight->GetNrows();
+    if (mean->GetNrows() != nCells || m2->GetNrows() != nCells) return false;
+
+    BinAccumulator& acc = state.acc;
+    acc = BinAccumulator(nCells);
+    std::copy(weight->GetMatrixArray(), weight->GetMatrixArray() + nCells, acc.GetWeightArray());
+    std::copy(mean->GetMatrixArray(), mean->GetMatrixArray() + nCells, acc.GetMeanArray());
+    std::copy(m2->GetMatrixArray(), m2->GetMatrixArray() + nCells, acc.GetM2Array());
+
+    std::unique_ptr<TVectorD> quantileMean((TVectorD*)stateDir->Get((name + "_qmean").c_str()));
+    std::unique_ptr<TVectorD> quantileWeight((TVectorD*)stateDir->Get((name + "_qweight").c_str()));
+    state.quantiles = BinQuantiles();
+    if (quantileMean && quantileWeight && quantileMean->GetNrows() == quantileWeight->GetNrows() &&
+        nCells > 0 && quantileMean->GetNrows() % nCells == 0) {
+        int nSlots = quantileMean->GetNrows();
+        state.quantiles = BinQuantiles(nCells, nSlots / nCells);
+        std::copy(quantileMean->GetMatrixArray(), quantileMean->GetMatrixArray() + nSlots, state.quantiles.GetMeanArray());
+        std::copy(quantileWeight->GetMatrixArray(), quantileWeight->GetMatrixArray() + nSlots, state.quantiles.GetWeightArray());
+        state.quantiles.Recount();
+    }
+
+    std::unique_ptr<TVectorD> bootstrapSum((TVectorD*)stateDir->Get((name + "_bsum").c_str()));
+    std::unique_ptr<TVectorD> bootstrapWeight((TVectorD*)stateDir->Get((name + "_bweight").c_str()));
+    state.bootstrap = BinBootstrap();
+    if (bootstrapSum && bootstrapWeight && bootstrapSum->GetNrows() == nCells * bootstrapWeight->GetNrows()) {
+        int nResamples = bootstrapWeight->GetNrows();
+        state.bootstrap = BinBootstrap(nCells, nResamples);
+        std::copy(bootstrapSum->GetMatrixArray(), bootstrapSum->GetMatrixArray() + nResamples * nCells,
+                  state.bootstrap.GetSumArray());
+        std::copy(bootstrapWeight->GetMatrixArray(), bootstrapWeight->GetMatrixArray() + nResamples,
+                  state.bootstrap.GetWeightArray());
+    }
+
+    std::unique_ptr<TVectorD> replicaValues((TVectorD*)stateDir->Get((name + "_jkvalues").c_str()));
+    std::unique_ptr<TVectorD> replicaWeights((TVectorD*)stateDir->Get((name + "_jkweights").c_str()));
+    std::unique_ptr<TObjString> replicaNames((TObjString*)stateDir->Get((name + "_jkreplicas").c_str()));
+    state.replicas = BinJackknife();
+    if (replicaValues && replicaWeights && replicaNames &&
+        replicaValues->GetNrows() == nCells * replicaWeights->GetNrows()) {
+        state.replicas = BinJackknife(nCells);
+        std::istringstream keys(replicaNames->GetName());
+        std::string key;
+        for (int r = 0; r < replicaWeights->GetNrows() && std::getline(keys, key); ++r) {
+            state.replicas.AddReplica(key, (*replicaWeights)[r], replicaValues->GetMatrixArray() + r * nCells);
+        }
+    }
+
+    // The covariance header holds its weight and band, which fixes the packed size
+    std::unique_ptr<TVectorD> covarianceInfo((TVectorD*)stateDir->Get((name + "_covinfo").c_str()));
+    std::unique_ptr<TVectorD> covarianceMean((TVectorD*)stateDir->Get((name + "_covmean").c_str()));
+    std::unique_ptr<TVectorD> covarianceM2((TVectorD*)stateDir->Get((name + "_covm2").c_str()));
+    state.covariance = BinCovariance();
+    if (covarianceInfo && covarianceMean && covarianceM2 && covarianceInfo->GetNrows() == 2 && (*covarianceInfo)[1] >= 0.0) {
+        int nBins = covarianceMean->GetNrows();
+        BinCovariance covariance(nBins, (size_t)(*covarianceInfo)[1]);
+        if ((int)covariance.ComomentSize() == covarianceM2->GetNrows()) {
+            std::copy(covarianceMean->GetMatrixArray(), covarianceMean->GetMatrixArray() + nBins, covariance.GetMeanArray());
+            std::copy(covarianceM2->GetMatrixArray(), covarianceM2->GetMatrixArray() + covarianceM2->GetNrows(),
+                      covariance.GetComomentArray());
+            covariance.SetWeight((*covarianceInfo)[0]);
+            state.covariance = std::move(covariance);
+        }
+    }
+    return true;
+}
+
+// Read the manifest of a file written with --keep-state; returns false if it has none
+bool ReadManifest(TFile* file, std::vector<std::string>& inputNames) {
+    std::unique_ptr<TList> list((TList*)file->Get((std::string(kMergeStateDir) + "/" + kManifestName).c_str()));
+    if (!list) return false;
+    list->SetOwner();
+    TIter next(list.get());
+    while (TObject* entry = next()) inputNames.push_back(entry->GetName());
+    return true;
+}
+
+// Append the replica scores recorded in a merged output to scores; false if it has none
+bool ReadReplicaScores(TFile* file, std::vector<std::string>& scores) {
+    std::unique_ptr<TList> list((TList*)file->Get((std::string(kMergeInfoDir) + "/" + kReplicaScoresName).c_str()));
+    if (!list) return false;
+    list->SetOwner();
+    TIter next(list.get());
+    while (TObject* entry = next()) scores.push_back(entry->GetName());
+    return true;
+}
+
+// Manifest entries contributed by an opened input: its own manifest if it is a merged
+// output, else its own normalized path
+void AppendToManifest(std::vector<std::string>& manifest, TFile* file, const std::string& fileName, bool hasState) {
+    if (!hasState || !ReadManifest(file, manifest)) {
+        manifest.push_back(fs::path(fileName).lexically_normal().string());
+    }
+}
+
+// Write the manifest into the state directory of the output
+void WriteManifest(MergeContext& ctx) {
+    TList list;
+    list.SetOwner();
+    for (const auto& name : ctx.manifest) list.Add(new TObjString(name.c_str()));
+    TDirectory* stateDir = ctx.outputFile->mkdir(kMergeStateDir, "", true);
+    stateDir->WriteTObject(&list, kManifestName);
+}
+
+// Read the state of a histogram from opened input file i while holding that file's lock
+bool GetStateFromInput(MergeContext& ctx, size_t i, const MergeItem& item, HistogramState& state) {
+    std::lock_guard<std::mutex> lock(ctx.inputMutexes[i]);
+    return ReadHistogramState(ctx.inputFiles[i].get(), item.dirPath, item.name, state);
+}
+
+// Run body(i) for i in [0, n), on the thread pool if there is one
+template <typename F>
+void ForEachIndex(MergeContext& ctx, unsigned n, F body) {
+    if (ctx.pool) {
+        ctx.pool->Foreach(body, ROOT::TSeqU(n));
+    } else {
+        for (unsigned i = 0; i < n; ++i) body(i);
+    }
+}
+
+// Number of cells (bins including underflow and overflow) of a Dim-dimensional histogram.
+// Axes beyond Dim are not counted, so a TH1 is no longer walked once per (j, k) pair.
+template <int Dim>
+int NumCells(const TH1* h) {
+    static_assert(Dim >= 1 && Dim <= 3, "Histograms have one to three dimensions");
+    int nCells = h->GetNbinsX() + 2;
+    if (Dim > 1) nCells *= h->GetNbinsY() + 2; // For 2D histograms
+    if (Dim > 2) nCells *= h->GetNbinsZ() + 2; // For 3D histograms
+    return nCells;
+}
+
+// Whether two axes have the same bins: their number, range and, if either has variable
+// bins, every edge, up to a millionth of the first bin's width
+bool SameAxis(const TAxis* a, const TAxis* b) {
+    int nBins = a->GetNbins();
+    if (b->GetNbins() != nBins) return false;
+    double tolerance = 1e-6 * std::fabs(a->GetBinWidth(1));
+    auto same = [tolerance](double x, double y) { return std::fabs(x - y) <= tolerance; };
+    if (!same(a->GetXmin(), b->GetXmin()) || !same(a->GetXmax(), b->GetXmax())) return false;
+    if (a->IsVariableBinSize() || b->IsVariableBinSize()) {
+        for (int bin = 2; bin <= nBins; ++bin) {
+            if (!same(a->GetBinLowEdge(bin), b->GetBinLowEdge(bin))) return false;
+        }
+    }
+    return true;
+}
+
+// Whether two histograms have the same dimension and the same bins on every axis, as
+// TH1::CheckConsistency checks before adding them; the number of cells alone does not
+// tell 100 x 20 from 20 x 100 bins or a rebinned axis
+bool SameBinning(const TH1* a, const TH1* b) {
+    int dim = a->GetDimension();
+    if (b->GetDimension() != dim || !SameAxis(a->GetXaxis(), b->GetXaxis())) return false;
+    if (dim > 1 && !SameAxis(a->GetYaxis(), b->GetYaxis())) return false;
+    return dim < 3 || SameAxis(a->GetZaxis(), b->GetZaxis());
+}
+
+// Fold the content of every cell of h into a per-bin accumulator or sketch, by global bin
+// index. The weight is a number, or the per-resample weights for a bootstrap.
+template <int Dim, typename Acc, typename Weight>
+void FoldBins(const TH1* h, Acc& acc, Weight weight) {
+    const int nCells = NumCells<Dim>(h);
+    for (int bin = 0; bin < nCells; ++bin) {
+        acc.Fill(bin, h->GetBinContent(bin), weight);
+    }
+}
+
+// Squared bin error of a merged bin under the chosen policy
+double BinErrorSquared(const BinAccumulator& acc, int bin, ErrorPolicy policy) {
+    double variance = acc.Variance(bin);
+    double weight = acc.Weight(bin);
+    switch (policy) {
+        case ErrorPolicy::kSample:      return weight > 1.0 ? variance * weight / (weight - 1.0) : 0.0;
+        case ErrorPolicy::kErrorOfMean: return weight > 0.0 ? variance / weight : 0.0;
+        default:                        return variance;
+    }
+}
+
+// Store the accumulated mean and its spread as bin content and error
+template <int Dim>
+void StoreMoments(TH1* histClone, const BinAccumulator& acc, ErrorPolicy policy) {
+    const int nCells = NumCells<Dim>(histClone);
+    for (int bin = 0; bin < nCells; ++bin) {
+        histClone->SetBinContent(bin, acc.Mean(bin));
+        histClone->SetBinError(bin, std::sqrt(BinErrorSquared(acc, bin, policy)));
+    }
+}
+
+// How the bins of a histogram class are stored
+enum class BinStorage { kGeneric, kDouble, kFloat };
+
+// Plain TH1/TH2/TH3 D and F histograms keep their cells in one contiguous TArrayD or
+// TArrayF indexed by global bin, which can be read and written directly. Profiles,
+// TH2Poly, integer histograms and other classes go through the generic TH1 interface.
+BinStorage GetBinStorage(const TH1* h) {
+    TClass* cl = h->IsA();
+    if (cl == TH1D::Class() || cl == TH2D::Class() || cl == TH3D::Class()) return BinStorage::kDouble;
+    if (cl == TH1F::Class() || cl == TH2F::Class() || cl == TH3F::Class()) return BinStorage::kFloat;
+    return BinStorage::kGeneric;
+}
+
+// Fold one input histogram with a weight into a per-bin accumulator or sketch, straight
+// from its bin array when possible
+template <int Dim, typename Acc, typename Weight>
+void FoldHistogram(const TH1* h, Acc& acc, Weight weight) {
+    switch (GetBinStorage(h)) {
+        case BinStorage::kDouble: acc.FillArray(dynamic_cast<const TArrayD*>(h)->GetArray(), weight); break;
+        case BinStorage::kFloat:  acc.FillArray(dynamic_cast<const TArrayF*>(h)->GetArray(), weight); break;
+        default:                  FoldBins<Dim>(h, acc, weight);
+    }
+}
+
+// Store mean and spread in histClone. For the plain D/F classes the mean is copied into
+// the bin array and the squared error into the sumw2 array in bulk, instead of one
+// SetBinContent/SetBinError call per bin.
+template <int Dim>
+void StoreHistogram(TH1* histClone, const BinAccumulator& acc, ErrorPolicy policy) {
+    BinStorage storage = GetBinStorage(histClone);
+    if (storage == BinStorage::kGeneric) {
+        StoreMoments<Dim>(histClone, acc, policy);
+        return;
+    }
+
+    const int nCells = acc.Size();
+    const double* mean = acc.GetMeanArray();
+    if (storage == BinStorage::kDouble) {
+        std::copy(mean, mean + nCells, dynamic_cast<TArrayD*>(histClone)->GetArray());
+    } else {
+        std::copy(mean, mean + nCells, dynamic_cast<TArrayF*>(histClone)->GetArray());
+    }
+
+    // The bin error is the square root of the sumw2 entry
+    if (histClone->GetSumw2N() == 0) histClone->Sumw2();
+    double* sumw2 = histClone->GetSumw2()->GetArray();
+    for (int bin = 0; bin < nCells; ++bin) sumw2[bin] = BinErrorSquared(acc, bin, policy);
+
+    // Same entry count the SetBinContent path leaves behind
+    histClone->SetEntries(nCells);
+}
+
+// Add the contents of every cell of h as one replica, from its bin array when possible
+template <int Dim>
+void AddReplica(const TH1* h, BinJackknife& replicas, const std::string& key, double weight) {
+    switch (GetBinStorage(h)) {
+        case BinStorage::kDouble: replicas.AddReplica(key, weight, dynamic_cast<const TArrayD*>(h)->GetArray()); break;
+        case BinStorage::kFloat:  replicas.AddReplica(key, weight, dynamic_cast<const TArrayF*>(h)->GetArray()); break;
+        default: {
+            std::vector<double> contents(NumCells<Dim>(h));
+            for (size_t bin = 0; bin < contents.size(); ++bin) contents[bin] = h->GetBinContent(bin);
+            replicas.AddReplica(key, weight, contents.data());
+        }
+    }
+}
+
+// Contents of the bins of h in range, without under- and overflow, x fastest
+template <int Dim>
+std::vector<double> InRangeContents(const TH1* h) {
+    int nx = h->GetNbinsX();
+    int ny = Dim > 1 ? h->GetNbinsY() : 1;
+    int nz = Dim > 2 ? h->GetNbinsZ() : 1;
+    std::vector<double> contents;
+    contents.reserve((size_t)nx * ny * nz);
+    for (int iz = 1; iz <= nz; ++iz) {
+        for (int iy = 1; iy <= ny; ++iy) {
+            for (int ix = 1; ix <= nx; ++ix) contents.push_back(h->GetBinContent(h->GetBin(ix, Dim > 1 ? iy : 0, Dim > 2 ? iz : 0)));
+        }
+    }
+    return contents;
+}
+
+// Fold the histogram of one input into the item's accumulator, quantile sketch,
+// bootstrap, replicas and covariance. If the input is a merged output with a saved
+// state, that partial state, which carries its own weights, is combined instead.
+template <int Dim>
+void FoldItemHistogram(MergeItem& item, const TH1* h, const HistogramState* state, double weight, const char* fileName) {
+    const int nCells = NumCells<Dim>(item.histClone ? item.histClone : h);
+    if (h->GetDimension() != Dim || NumCells<Dim>(h) != nCells || (item.histClone && !SameBinning(item.histClone, h)) ||
+        (state && (int)state->acc.Size() != nCells)) {
+        std::cerr << "Histogram " << item.Path()
+                  << " has a different binning in file " << fileName << ", skipped" << std::endl;
+        return;
+    }
+    if (item.acc.Size() == 0) item.acc = BinAccumulator(nCells);
+    if (item.withQuantiles && item.quantiles.Size() == 0) item.quantiles = BinQuantiles(nCells);
+    if (item.nResamples > 0 && item.bootstrap.Size() == 0) item.bootstrap = BinBootstrap(nCells, item.nResamples);
+    bool keepReplicas = !item.ratios.empty();
+    if (keepReplicas && item.replicas.Size() == 0) item.replicas = BinJackknife(nCells);
+    if (item.withCovariance && item.covariance.Size() == 0) {
+        item.covariance = BinCovariance(InRangeContents<Dim>(h).size(), item.covarianceBand);
+        // The tile rows run as nested tasks of the pool that folds the items, so a few
+        // large covariances still use all threads
+        if (ROOT::TThreadExecutor* pool = item.pool) {
+            item.covariance.SetExecutor([pool](size_t n, const std::function<void(size_t)>& body) {
+                pool->Foreach([&body](unsigned t) { body(t); }, ROOT::TSeqU(n));
+            });
+        }
+    }
+    if (state) {
+        item.acc.Merge(state->acc);
+        if (item.withQuantiles && !item.quantiles.Merge(state->quantiles)) {
+            std::cerr << "File " << fileName << " has no quantile state for " << item.Path()
+                      << ", its replicas are left out of the quantiles" << std::endl;
+        }
+        if (item.nResamples > 0 && !item.bootstrap.Merge(state->bootstrap)) {
+            std::cerr << "File " << fileName << " has no bootstrap state for " << item.Path()
+                      << ", its replicas are left out of the bootstrap" << std::endl;
+        }
+        if (keepReplicas && !item.replicas.Merge(state->replicas)) {
+            std::cerr << "File " << fileName << " has no replica state for " << item.Path()
+                      << ", its replicas are left out of the jackknife" << std::endl;
+        }
+        if (item.withCovariance && !item.covariance.Merge(state->covariance)) {
+            std::cerr << "File " << fileName << " has no covariance state with the same band for " << item.Path()
+                      << ", its replicas are left out of the covariance" << std::endl;
+        }
+    } else {
+        FoldHistogram<Dim>(h, item.acc, weight);
+        if (item.withQuantiles) FoldHistogram<Dim>(h, item.quantiles, weight);
+        if (item.nResamples > 0) {
+            // The resample weights depend on the replica, not on the order of the inputs
+            std::vector<double> weights = BinBootstrap::PoissonWeights(
+                item.bootstrapSeed, fs::path(fileName).lexically_normal().string(), item.nResamples);
+            for (double& w : weights) w *= weight;
+            FoldHistogram<Dim>(h, item.bootstrap, weights.data());
+            item.bootstrap.AddWeights(weights.data());
+        }
+        if (keepReplicas && weight > 0.0) AddReplica<Dim>(h, item.replicas, fs::path(fileName).lexically_normal().string(), weight);
+        if (item.withCovariance) item.covariance.Fill(InRangeContents<Dim>(h).data(), weight);
+    }
+    ++item.nFound;
+}
+
+// Fold the copy of an item read from one input file (nullptr if missing) into its state.
+// Each input histogram is folded as a whole bin array before the next file is visited;
+// state is the saved accumulator of the histogram if the input is a merged output, and
+// weight the input's weight in the histogram moments (parameters are not weighted).
+// The first copy folded is kept as the item's output object: it is taken over and obj
+// is set to nullptr. Any other copy stays with the caller.
+void FoldInput(MergeItem& item, TObject*& obj, const HistogramState* state, double weight, const char* fileName) {
+    bool isHistogram = item.kind == ObjectKind::kHistogram;
+    if (!obj) {
+        std::cerr << (isHistogram ? "Histogram " : "Parameter ") << item.Path()
+                  << " could not be read from file " << fileName << std::endl;
+        return;
+    }
+
+    if (isHistogram) {
+        if (!obj->InheritsFrom(TH1::Class())) {
+            std::cerr << "Object " << item.Path() << " is not a histogram in file " << fileName << std::endl;
+            return;
+        }
+        TH1* h = (TH1*)obj;
+        int nFound = item.nFound;
+        switch (item.histClone ? item.histClone->GetDimension() : h->GetDimension()) {
+            case 1: FoldItemHistogram<1>(item, h, state, weight, fileName); break;
+            case 2: FoldItemHistogram<2>(item, h, state, weight, fileName); break;
+            case 3: FoldItemHistogram<3>(item, h, state, weight, fileName); break;
+        }
+        if (!item.histClone && item.nFound > nFound) {
+            // Emptied, it receives the merged histogram; no template is held before
+            h->Reset();
+            item.histClone = h;
+            obj = nullptr;
+        }
+    } else {
+        // Parameters are reduced in their own value type, following the merge mode of
+        // the first input's copy
+        if (FindParameterFold(obj->IsA()) != item.foldParameter) {
+            std::cerr << "Parameter " << item.Path() << " has a different type in file " << fileName << ", skipped" << std::endl;
+            return;
+        }
+        if (item.paramTotal) {
+            if (!item.foldParameter(item.paramTotal, obj, fileName)) {
+                std::cerr << "Parameter " << item.Path() << " has an unknown merge mode, its value in file "
+                          << fileName << " is left out" << std::endl;
+                return;
+            }
+        } else {
+            item.paramTotal = obj;
+            obj = nullptr;
+        }
+        ++item.nFound;
+    }
+}
+
+// Write one histogram per percent level next to the merged histogram, named
+// <name><suffix><level>, with the values of that level (level-major, one per cell) as
+// bin content and no error. Returns the number of bytes written.
+int WriteLevelHistograms(MergeContext& ctx, const MergeItem& item, const char* suffix, const char* what,
+                         const std::vector<double>& levels, const std::vector<double>& values) {
+    const int nCells = item.acc.Size();
+    int nBytes = 0;
+    for (size_t k = 0; k < levels.size(); ++k) {
+        std::ostringstream name, title;
+        name << item.name << suffix << levels[k];
+        title << item.histClone->GetTitle() << " (" << levels[k] << "% " << what << ")";
+        std::unique_ptr<TH1> h((TH1*)item.histClone->Clone(name.str().c_str()));
+        h->SetTitle(title.str().c_str());
+        for (int bin = 0; bin < nCells; ++bin) h->SetBinContent(bin, values[k * nCells + bin]);
+        if (h->GetSumw2N() > 0) h->GetSumw2()->Reset();
+        h->SetEntries(nCells);
+        nBytes += WriteOutput(ctx, item.outputDir, h.get());
+    }
+    return nBytes;
+}
+
+// Values at the percent levels for every cell, level-major, from a function filling the
+// values of one cell for the levels as fractions
+template <typename F>
+std::vector<double> LevelValues(int nCells, const std::vector<double>& levels, F cellValues) {
+    std::vector<double> fractions;
+    for (double level : levels) fractions.push_back(level / 100.0);
+    std::vector<double> values(levels.size() * nCells);
+    std::vector<double> cell(levels.size());
+    for (int bin = 0; bin < nCells; ++bin) {
+        cellValues(bin, fractions.data(), cell.data());
+        for (size_t k = 0; k < levels.size(); ++k) values[k * nCells + bin] = cell[k];
+    }
+    return values;
+}
+
+// Write the quantiles of the replicas, <name>_q<level>. Returns the bytes written.
+int WriteQuantileHistograms(MergeContext& ctx, const MergeItem& item) {
+    const std::vector<double>& levels = ctx.options.quantiles;
+    std::vector<double> values = LevelValues(item.quantiles.Size(), levels, [&](int bin, const double* qs, double* out) {
+        item.quantiles.Quantiles(bin, qs, levels.size(), out);
+    });
+    return WriteLevelHistograms(ctx, item, "_q", "quantile", levels, values);
+}
+
+// Write the percentile bands of the bootstrapped bin means, <name>_boot<level>. Returns
+// the number of bytes written.
+int WriteBootstrapHistograms(MergeContext& ctx, const MergeItem& item) {
+    const std::vector<double>& levels = ctx.options.bootstrapLevels;
+    std::vector<double> values = LevelValues(item.bootstrap.Size(), levels, [&](int bin, const double* qs, double* out) {
+        item.bootstrap.Percentiles(bin, qs, levels.size(), out);
+    });
+    return WriteLevelHistograms(ctx, item, "_boot", "bootstrap band", levels, values);
+}
+
+// Delete-one jackknife variance of the mean of a bin. For the mean it has the closed
+// form s^2 / N, with s^2 the sample variance, so it follows from the moments; replica
+// weights count as multiplicities.
+double JackknifeVariance(const BinAccumulator& acc, int bin) {
+    double weight = acc.Weight(bin);
+    return weight > 1.0 ? acc.M2(bin) / (weight * (weight - 1.0)) : 0.0;
+}
+
+// Write a copy of a merged histogram named <name>_jkvar with the values, one per cell,
+// as bin content and no error. Returns the number of bytes written.
+int WriteVarianceHistogram(MergeContext& ctx, TDirectory* outputDir, const TH1* shape, const std::string& name,
+                           const std::vector<double>& values) {
+    std::unique_ptr<TH1> h((TH1*)shape->Clone((name + "_jkvar").c_str()));
+    h->SetTitle((std::string(shape->GetTitle()) + " (jackknife variance)").c_str());
+    for (size_t bin = 0; bin < values.size(); ++bin) h->SetBinContent(bin, values[bin]);
+    if (h->GetSumw2N() > 0) h->GetSumw2()->Reset();
+    h->SetEntries(values.size());
+    return WriteOutput(ctx, outputDir, h.get());
+}
+
+// Compute a ratio whose operands have both been handed over and write it, with the
+// jackknife error as bin error, and its variance histogram
+void FinishRatio(MergeContext& ctx, RatioJob& job) {
+    std::vector<double> ratio, variance;
+    size_t nReplicas = BinJackknife::Ratio(job.numerator, job.denominator, ratio, variance);
+    if (nReplicas == 0) {
+        std::cerr << "Ratio " << job.name << ": " << job.numeratorPath << " and " << job.denominatorPath
+                  << " have no replicas in common, not written" << std::endl;
+    } else {
+        TH1* h = job.shape;
+        h->SetTitle((job.numeratorPath + " / " + job.denominatorPath).c_str());
+        if (h->GetSumw2N() == 0) h->Sumw2();
+        double* sumw2 = h->GetSumw2()->GetArray();
+        for (size_t bin = 0; bin < ratio.size(); ++bin) {
+            h->SetBinContent(bin, ratio[bin]);
+            sumw2[bin] = variance[bin];
+        }
+        h->SetEntries(ratio.size());
+        WriteOutput(ctx, job.outputDir, h);
+        WriteVarianceHistogram(ctx, job.outputDir, h, job.name, variance);
+    }
+    delete job.shape;
+    job.shape = nullptr;
+    job.numerator = BinJackknife();
+    job.denominator = BinJackknife();
+}
+
+// Hand the replicas of a finished histogram over to the ratios it is an operand of,
+// writing those that are complete
+void HandOverReplicas(MergeContext& ctx, MergeItem& item) {
+    for (size_t j : item.ratios) {
+        RatioJob& job = ctx.ratios[j];
+        bool complete;
+        {
+            std::lock_guard<std::mutex> lock(ctx.ratioMutex);
+            if (job.numeratorPath == item.Path()) {
+                job.numerator = item.replicas;
+                job.shape = (TH1*)item.histClone->Clone(job.name.c_str());
+                ++job.nReady;
+            }
+            if (job.denominatorPath == item.Path()) {
+                job.denominator = item.replicas;
+                ++job.nReady;
+            }
+            complete = job.nReady == 2;
+        }
+        if (complete) FinishRatio(ctx, job);
+    }
+    item.replicas = BinJackknife();
+}
+
+// Read the ratio config and attach every ratio to its operands among the items
+void SetUpRatios(MergeContext& ctx) {
+    const std::string& configName = ctx.options.jackknifeRatioFileName;
+    if (configName.empty()) return;
+    std::ifstream in(configName);
+    if (!in) {
+        std::cerr << "Cannot read the ratio config " << configName << ", no ratios written" << std::endl;
+        return;
+    }
+    std::unordered_map<std::string, size_t> histogramItem;
+    for (size_t n = 0; n < ctx.items.size(); ++n) {
+        if (ctx.items[n].kind == ObjectKind::kHistogram) histogramItem[ctx.items[n].Path()] = n;
+    }
+
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream words(line.substr(0, line.find('#')));
+        RatioJob job;
+        if (!(words >> job.name)) continue;
+        if (!(words >> job.numeratorPath >> job.denominatorPath)) {
+            std::cerr << "Ratio " << job.name << " needs a numerator and a denominator in " << configName << std::endl;
+            continue;
+        }
+        auto numerator = histogramItem.find(job.numeratorPath);
+        auto denominator = histogramItem.find(job.denominatorPath);
+        if (numerator == histogramItem.end() || denominator == histogramItem.end()) {
+            std::cerr << "Ratio " << job.name << ": no histogram "
+                      << (numerator == histogramItem.end() ? job.numeratorPath : job.denominatorPath)
+                      << " to merge, not written" << std::endl;
+            continue;
+        }
+        // The ratio goes next to its numerator
+        job.outputDir = ctx.items[numerator->second].outputDir;
+        ctx.items[numerator->second].ratios.push_back(ctx.ratios.size());
+        if (denominator->second != numerator->second) ctx.items[denominator->second].ratios.push_back(ctx.ratios.size());
+        ctx.ratios.push_back(job);
+    }
+}
+
+// Write the covariance of a histogram's bins in range as <name>_cov and their
+// correlation as a TH2D <name>_corr. The covariance is normalized like the bin errors
+// (see ErrorPolicy), so its diagonal holds their squares. The full matrix is a
+// TMatrixDSym and the correlation has the bins on both axes. With a band only the band
+// is written, so memory stays linear in the bins: the covariance as a TMatrixDSparse and
+// the correlation over the bin and the offset k - j of the other bin. The bins of a 1D
+// histogram keep its binning, others are numbered. Returns the bytes written.
+int WriteCovariance(MergeContext& ctx, MergeItem& item) {
+    BinCovariance& covariance = item.covariance;
+    covariance.Flush();
+    const int n = covariance.Size();
+    const int band = covariance.Band();
+    double weight = covariance.Weight();
+    double norm = 0.0;
+    switch (ctx.options.errorPolicy) {
+        case ErrorPolicy::kSample:      norm = weight > 1.0 ? 1.0 / (weight - 1.0) : 0.0; break;
+        case ErrorPolicy::kErrorOfMean: norm = weight > 0.0 ? 1.0 / (weight * weight) : 0.0; break;
+        default:                        norm = weight > 0.0 ? 1.0 / weight : 0.0; break;
+    }
+    std::vector<double> variance(n);
+    for (int j = 0; j < n; ++j) variance[j] = norm * covariance.Comoment(j, j);
+    auto correlationOf = [&](int j, int k) {
+        double scale = std::sqrt(variance[j] * variance[k]);
+        return scale > 0.0 ? norm * covariance.Comoment(j, k) / scale : 0.0;
+    };
+
+    std::vector<double> edges(n + 1);
+    const TAxis* axis = item.histClone->GetXaxis();
+    for (int j = 0; j <= n; ++j) {
+        edges[j] = item.histClone->GetDimension() == 1 ? axis->GetBinLowEdge(j + 1) : j;
+    }
+    std::string name = item.name + "_corr";
+    std::string title = std::string(item.histClone->GetTitle()) + " (bin correlation)";
+    std::string covName = item.name + "_cov";
+    int nBytes = 0;
+
+    if (band >= n - 1) {
+        TMatrixDSym matrix(n);
+        for (int j = 0; j < n; ++j) {
+            for (int k = 0; k <= j; ++k) matrix(j, k) = matrix(k, j) = norm * covariance.Comoment(j, k);
+        }
+        nBytes += WriteOutput(ctx, item.outputDir, &matrix, covName.c_str());
+
+        TH2D correlation(name.c_str(), title.c_str(), n, edges.data(), n, edges.data());
+        for (int j = 0; j < n; ++j) {
+            for (int k = 0; k < n; ++k) correlation.SetBinContent(j + 1, k + 1, correlationOf(j, k));
+        }
+        correlation.SetEntries((double)n * n);
+        nBytes += WriteOutput(ctx, item.outputDir, &correlation);
+        return nBytes;
+    }
+
+    // Both triangles of the band, row by row with the columns in order
+    std::vector<int> rows, columns;
+    std::vector<double> values;
+    for (int j = 0; j < n; ++j) {
+        for (int k = std::max(0, j - band); k <= std::min(n - 1, j + band); ++k) {
+            rows.push_back(j);
+            columns.push_back(k);
+            values.push_back(norm * covariance.Comoment(j, k));
+        }
+    }
+    TMatrixDSparse matrix(0, n - 1, 0, n - 1, values.size(), rows.data(), columns.data(), values.data());
+    nBytes += WriteOutput(ctx, item.outputDir, &matrix, covName.c_str());
+
+    title = std::string(item.histClone->GetTitle()) + " (bin correlation by offset)";
+    TH2D correlation(name.c_str(), title.c_str(), n, edges.data(), 2 * band + 1, -band - 0.5, band + 0.5);
+    for (int j = 0; j < n; ++j) {
+        for (int k = std::max(0, j - band); k <= std::min(n - 1, j + band); ++k) {
+            correlation.SetBinContent(j + 1, k - j + band + 1, correlationOf(j, k));
+        }
+    }
+    correlation.SetEntries((double)values.size());
+    nBytes += WriteOutput(ctx, item.outputDir, &correlation);
+    return nBytes;
+}
+
+// Store the merged result of an item, write it to the output and free its state
+void FinishItem(MergeContext& ctx, MergeItem& item) {
+    auto start = std::chrono::steady_clock::now();
+    int nBytes = 0;
+    if (item.kind == ObjectKind::kHistogram && !item.histClone) {
+        std::cerr << "Histogram " << item.Path() << " could not be read from any file, not written" << std::endl;
+    } else if (item.kind == ObjectKind::kHistogram) {
+        // Mean and standard deviation over the inputs become bin content and bin error
+        switch (item.histClone->GetDimension()) {
+            case 1: StoreHistogram<1>(item.histClone, item.acc, ctx.options.errorPolicy); break;
+            case 2: StoreHistogram<2>(item.histClone, item.acc, ctx.options.errorPolicy); break;
+            case 3: StoreHistogram<3>(item.histClone, item.acc, ctx.options.errorPolicy); break;
+        }
+        item.timing.reduceSeconds += MergeStats::Seconds(start);
+        start = std::chrono::steady_clock::now();
+        nBytes = WriteOutput(ctx, item.outputDir, item.histClone);
+        if (item.withQuantiles) nBytes += WriteQuantileHistograms(ctx, item);
+        if (item.nResamples > 0) nBytes += WriteBootstrapHistograms(ctx, item);
+        if (ctx.options.jackknife) {
+            std::vector<double> variance(item.acc.Size());
+            for (size_t bin = 0; bin < variance.size(); ++bin) variance[bin] = JackknifeVariance(item.acc, bin);
+            nBytes += WriteVarianceHistogram(ctx, item.outputDir, item.histClone, item.name, variance);
+        }
+        if (item.withCovariance && item.covariance.Size() > 0) nBytes += WriteCovariance(ctx, item);
+        if (ctx.options.keepState) WriteHistogramState(ctx, item);
+        if (!item.ratios.empty()) HandOverReplicas(ctx, item);
+        delete item.histClone;
+        item.histClone = nullptr;
+        item.acc = BinAccumulator();
+        item.quantiles = BinQuantiles();
+        item.bootstrap = BinBootstrap();
+        item.covariance = BinCovariance();
+    } else if (item.paramTotal) {
+        // The merged parameter keeps the class and merge mode of its inputs
+        nBytes = WriteOutput(ctx, item.outputDir, item.paramTotal);
+        delete item.paramTotal;
+        item.paramTotal = nullptr;
+    }
+    item.timing.writeSeconds += MergeStats::Seconds(start);
+    item.timing.bytesWritten += nBytes;
+    item.timing.path = item.Path();
+    item.timing.className = ctx.entries[item.entry].className;
+    ctx.stats->AddObject(item.timing);
+}
+
+// Weight of an input file, 1 unless an input list gave another
+double InputWeight(const MergeOptions& options, const std::string& fileName) {
+    auto found = options.inputWeights.find(fileName);
+    return found == options.inputWeights.end() ? 1.0 : found->second;
+}
+
+// Objects of one input read in the background for the streaming mode, one per item of
+// the current pass
+struct InputData {
+    std::string fileName;
+    bool opened = false;
+    std::vector<TObject*> objects; // nullptr where the input lacks the item
+    std::vector<HistogramState> states; // Saved histogram states of a merged output, empty otherwise
+    std::vector<std::string> manifest;  // Replica files behind this input
+    std::vector<std::string> replicaScores; // Scores of those replicas, if it is a merged output that has them
+    std::vector<char> present;          // Per item: whether the key index found it in this input
+    std::vector<double> readSeconds;    // Per item: time spent reading it
+    std::vector<int> nBytes;            // Per item: compressed size of its key
+    long long bytesRead = 0;            // Bytes read from the file in total
+    double weight = 1.0;                // Weight of the input
+    size_t input = 0;                   // Index of the input
+};
+
+// Fold input data into item n and release the objects read for it
+void FoldInputData(MergeItem& item, InputData& data, size_t n) {
+    if (!data.present[n]) return; // Absent from this input, reported by the key index
+    item.timing.readSeconds += data.readSeconds[n];
+    item.timing.bytesRead += data.nBytes[n];
+    auto start = std::chrono::steady_clock::now();
+    const HistogramState* state = n < data.states.size() && data.states[n].acc.Size() > 0 ? &data.states[n] : nullptr;
+    FoldInput(item, data.objects[n], state, data.weight, data.fileName.c_str());
+    item.timing.reduceSeconds += MergeStats::Seconds(start);
+    delete data.objects[n];
+    data.objects[n] = nullptr;
+    if (state) data.states[n] = HistogramState();
+}
+
+// Open an input, read items [begin, end) from it and close it again. Histograms are
+// detached from the file first, so the file handle is released before the objects are
+// folded.
+InputData ReadInput(const MergeContext& ctx, size_t input, size_t begin, size_t end) {
+    size_t nItems = end - begin;
+    const std::string& fileName = ctx.inputNames[input];
+    InputData data;
+    data.fileName = fileName;
+    data.weight = InputWeight(ctx.options, fileName);
+    data.input = input;
+    TFile* file = TFile::Open(fileName.c_str());
+    if (!file || file->IsZombie()) {
+        delete file;
+        return data;
+    }
+    data.opened = true;
+    bool hasState = file->GetDirectory(kMergeStateDir) != nullptr;
+    AppendToManifest(data.manifest, file, fileName, hasState);
+    if (ctx.options.outlierThreshold > 0.0) ReadReplicaScores(file, data.replicaScores);
+    data.objects.reserve(nItems);
+    if (hasState) data.states.resize(nItems);
+    data.present.resize(nItems);
+    data.readSeconds.resize(nItems);
+    data.nBytes.resize(nItems);
+    for (size_t n = 0; n < nItems; ++n) {
+        const MergeItem& item = ctx.items[begin + n];
+        auto start = std::chrono::steady_clock::now();
+        data.present[n] = ctx.entries[item.entry].present[input];
+        TKey* key = data.present[n] ? GetKeyFromDirectory(file, item.dirPath, item.name) : nullptr;
+        TObject* obj = key ? key->ReadObj() : nullptr;
+        if (obj && obj->InheritsFrom(TH1::Class())) ((TH1*)obj)->SetDirectory(nullptr);
+        data.objects.push_back(obj);
+        if (key) data.nBytes[n] = key->GetNbytes();
+        if (hasState && item.kind == ObjectKind::kHistogram && obj &&
+            !ReadHistogramState(file, item.dirPath, item.name, data.states[n])) {
+            std::cerr << "File " << fileName << " has no merge state for " << item.Path()
+                      << ", merged as a single replica" << std::endl;
+        }
+        data.readSeconds[n] = MergeStats::Seconds(start);
+    }
+    data.bytesRead = file->GetBytesRead();
+    file->Close();
+    delete file;
+    return data;
+}
+
+// Release the objects read from an input without folding them
+void ReleaseInputData(InputData& data) {
+    for (auto*& obj : data.objects) {
+        delete obj;
+        obj = nullptr;
+    }
+    data.states.clear();
+}
+
+// Fold an input read for the items of a pass, starting at item begin, with its weight
+// scaled by its outlier factor, and release it. An input the outlier detection left out
+// is only released; on the first pass the others join the manifest, and the replica
+// scores recorded in a merged input are kept.
+void FoldPassInput(MergeContext& ctx, InputData& data, size_t begin, bool firstPass) {
+    double factor = ctx.inputFactors[data.input];
+    if (factor > 0.0) {
+        if (firstPass) {
+            ctx.manifest.insert(ctx.manifest.end(), data.manifest.begin(), data.manifest.end());
+            ctx.replicaScores.insert(ctx.replicaScores.end(), data.replicaScores.begin(), data.replicaScores.end());
+            ctx.nReferenceReplicas += data.manifest.size();
+        }
+        data.weight *= factor;
+        // Items are independent, so this input is folded into them in parallel
+        ForEachIndex(ctx, data.objects.size(), [&ctx, &data, begin](unsigned n) {
+            FoldInputData(ctx.items[begin + n], data, n);
+        });
+    }
+    ReleaseInputData(data);
+}
+
+// Number of cells of a histogram of any dimension
+int NumCells(const TH1* h) {
+    switch (h->GetDimension()) {
+        case 1: return NumCells<1>(h);
+        case 2: return NumCells<2>(h);
+        default: return NumCells<3>(h);
+    }
+}
+
+// Fold a histogram of any dimension into a scorer, from its bin array when possible
+template <typename Scorer>
+void FoldIntoScorer(const TH1* h, Scorer& scorer) {
+    switch (h->GetDimension()) {
+        case 1: FoldHistogram<1>(h, scorer, 1.0); break;
+        case 2: FoldHistogram<2>(h, scorer, 1.0); break;
+        case 3: FoldHistogram<3>(h, scorer, 1.0); break;
+    }
+}
+
+// Histogram read from a single replica for item n of a pass, nullptr if there is none
+const TH1* ReplicaHistogram(const MergeItem& item, const InputData& data, size_t n) {
+    const TObject* obj = data.objects[n];
+    if (item.kind != ObjectKind::kHistogram || !obj || !obj->InheritsFrom(TH1::Class())) return nullptr;
+    return (const TH1*)obj;
+}
+
+// Score of a replica against the running moments of the items of a pass, summed over
+// its histograms; histograms with another binning are not scored
+ReplicaScore ScoreReplica(MergeContext& ctx, const InputData& data, size_t begin) {
+    std::vector<ReplicaScore> scores(data.objects.size());
+    ForEachIndex(ctx, data.objects.size(), [&ctx, &data, &scores, begin](unsigned n) {
+        const MergeItem& item = ctx.items[begin + n];
+        const TH1* h = ReplicaHistogram(item, data, n);
+        if (!h || NumCells(h) != (int)item.acc.Size() || (item.histClone && !SameBinning(item.histClone, h))) return;
+        PullScorer scorer(item.acc);
+        FoldIntoScorer(h, scorer);
+        scores[n] = scorer.Score();
+    });
+    ReplicaScore total;
+    for (const auto& score : scores) total.Add(score);
+    return total;
+}
+
+// Scores of replicas held back while too few were merged, against each other
+std::vector<ReplicaScore> ScoreWarmup(MergeContext& ctx, const std::vector<InputData>& warmup, size_t begin) {
+    size_t nItems = warmup.front().objects.size();
+    std::vector<std::vector<ReplicaScore>> scores(nItems);
+    ForEachIndex(ctx, nItems, [&ctx, &warmup, &scores, begin](unsigned n) {
+        const MergeItem& item = ctx.items[begin + n];
+        MedianScorer scorer;
+        const TH1* first = item.histClone; // Whose binning the others must have
+        int nCells = first ? NumCells(first) : -1;
+        if (first) scorer = MedianScorer(nCells, warmup.size());
+        for (size_t r = 0; r < warmup.size(); ++r) {
+            const TH1* h = ReplicaHistogram(item, warmup[r], n);
+            if (!h) continue;
+            if (!first) {
+                first = h;
+                nCells = NumCells(h);
+                scorer = MedianScorer(nCells, warmup.size());
+            }
+            if (!SameBinning(first, h)) continue;
+            scorer.Select(r);
+            FoldIntoScorer(h, scorer);
+        }
+        scores[n].resize(warmup.size());
+        if (nCells >= 0) scorer.AddScores(scores[n]);
+    });
+    std::vector<ReplicaScore> total(warmup.size());
+    for (const auto& itemScores : scores) {
+        for (size_t r = 0; r < itemScores.size(); ++r) total[r].Add(itemScores[r]);
+    }
+    return total;
+}
+
+// Weight factor of a replica from its score: 1 up to the outlier threshold, above it 0,
+// or threshold / score when outliers are down-weighted. Outliers are reported and every
+// score is recorded.
+double JudgeReplica(MergeContext& ctx, const std::string& fileName, const ReplicaScore& score) {
+    double threshold = ctx.options.outlierThreshold;
+    double factor = 1.0;
+    if (score.PerBin() > threshold) {
+        factor = ctx.options.outlierDownweight ? threshold / score.PerBin() : 0.0;
+        std::cout << "\nReplica " << fileName << " is an outlier (chi2 " << score.PerBin() << " per bin over "
+                  << score.ndf << " bins), " << (factor > 0.0 ? "down-weighted by " + std::to_string(factor) : "left out")
+                  << std::endl;
+    }
+    std::ostringstream line;
+    line << fs::path(fileName).lexically_normal().string() << "\t" << score.PerBin() << "\t" << score.ndf << "\t" << factor;
+    ctx.replicaScores.push_back(line.str());
+    return factor;
+}
+
+// Replicas held back and compared with each other before there is a running mean: the
+// requested number, but at least as many as the median needs
+size_t WarmupSize(const MergeOptions& opts) {
+    return std::max<size_t>(opts.outlierWarmup, MedianScorer::kMinReplicas);
+}
+
+// Score the replicas held back and fold them in order: against the running mean if
+// enough replicas are merged already, else against each other. Too few replicas for
+// either, as when there are only one or two inputs, are merged unjudged with a warning.
+void FoldWarmup(MergeContext& ctx, std::vector<InputData>& warmup, size_t begin) {
+    if (warmup.empty()) return;
+    if (ctx.nReferenceReplicas >= MedianScorer::kMinReplicas) {
+        for (auto& data : warmup) {
+            ctx.inputFactors[data.input] = JudgeReplica(ctx, data.fileName, ScoreReplica(ctx, data, begin));
+            FoldPassInput(ctx, data, begin, true);
+        }
+        warmup.clear();
+        return;
+    }
+    std::vector<ReplicaScore> scores(warmup.size());
+    if (warmup.size() >= MedianScorer::kMinReplicas) {
+        scores = ScoreWarmup(ctx, warmup, begin);
+    } else {
+        std::cerr << "\nWarning: " << ctx.nReferenceReplicas + warmup.size() << " replicas are too few to score; "
+                  << warmup.size() << " merged without an outlier check" << std::endl;
+    }
+    for (size_t r = 0; r < warmup.size(); ++r) {
+        ctx.inputFactors[warmup[r].input] = JudgeReplica(ctx, warmup[r].fileName, scores[r]);
+    }
+    for (auto& data : warmup) FoldPassInput(ctx, data, begin, true);
+    warmup.clear();
+}
+
+// Record the scores of the replicas in the output
+void WriteReplicaScores(MergeContext& ctx) {
+    TList list;
+    list.SetOwner();
+    for (const auto& line : ctx.replicaScores) list.Add(new TObjString(line.c_str()));
+    TDirectory* infoDir = ctx.outputFile->mkdir(kMergeInfoDir, "", true);
+    infoDir->WriteTObject(&list, kReplicaScoresName);
+}
+
+// Kind of merge for objects of a class
+ObjectKind KindOfClass(const std::string& className) {
+    TClass* cl = TClass::GetClass(className.c_str());
+    if (!cl) return ObjectKind::kOther;
+    if (cl->InheritsFrom(TH1::Class())) return ObjectKind::kHistogram;
+    if (FindParameterFold(cl)) return ObjectKind::kParameter;
+    if (cl->InheritsFrom(TTree::Class())) return ObjectKind::kTree;
+    if (cl->InheritsFrom(TDirectory::Class())) return ObjectKind::kDirectory;
+    return ObjectKind::kOther;
+}
+
+// Whether an object of a merged output was derived from its merged histograms, given the
+// state directory of its directory: histograms without a state of their own (quantiles,
+// bands, variances, correlations, ratios) and the covariance matrices of histograms
+bool IsDerivedObject(TDirectory* stateDir, const std::string& name, const char* className) {
+    if (KindOfClass(className) == ObjectKind::kHistogram) return !stateDir->GetKey((name + "_weight").c_str());
+    const std::string suffix = "_cov";
+    return name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0 &&
+           stateDir->GetKey((name.substr(0, name.size() - suffix.size()) + "_weight").c_str());
+}
+
+// Add the keys of one directory of input `input` to the key index, recursively.
+// Only the highest cycle of each name is used. Only keys are looked at: no object is
+// read to build the index. stateDir is the state directory of dir if the input is a
+// merged output, else nullptr.
+void IndexDirectory(MergeContext& ctx, size_t input, TDirectory* dir, const std::string& dirPath, bool keepKeys,
+                    TDirectory* stateDir) {
+    size_t nInputs = ctx.inputNames.size();
+    TIter nextKey(dir->GetListOfKeys());
+    TKey* key;
+    while ((key = (TKey*)nextKey())) {
+        std::string name = key->GetName();
+        // The merge state of an input that is a merged output is not an object to merge
+        if (dirPath.empty() && (name == kMergeStateDir || name == kMergeInfoDir)) continue;
+        // Neither are the objects it derived from the merged histograms, which are
+        // written again from the merged state
+        if (stateDir && IsDerivedObject(stateDir, name, key->GetClassName())) continue;
+
+        std::string path = dirPath.empty() ? name : dirPath + "/" + name;
+        auto found = ctx.entryIndex.find(path);
+        if (found == ctx.entryIndex.end()) {
+            KeyEntry entry;
+            entry.dirPath = dirPath;
+            entry.name = name;
+            entry.className = key->GetClassName();
+            entry.kind = KindOfClass(entry.className);
+            entry.cycle = key->GetCycle();
+            entry.present.assign(nInputs, 0);
+            if (keepKeys) entry.keys.assign(nInputs, nullptr);
+            entry.objLen = key->GetObjlen();
+            found = ctx.entryIndex.emplace(path, ctx.entries.size()).first;
+            ctx.entries.push_back(std::move(entry));
+        }
+
+        KeyEntry& entry = ctx.entries[found->second];
+        if (entry.present[input]) continue; // A lower cycle of a key already indexed
+        if (entry.className != key->GetClassName()) {
+            std::cerr << "Object " << path << " is a " << key->GetClassName() << " in file "
+                      << ctx.inputNames[input] << " but a " << entry.className << " elsewhere, skipped there" << std::endl;
+            continue;
+        }
+        entry.present[input] = 1;
+        ++entry.nPresent;
+        if (keepKeys) entry.keys[input] = key;
+
+        if (entry.kind == ObjectKind::kDirectory) {
+            TDirectory* subDir = dir->GetDirectory(name.c_str());
+            TDirectory* subStateDir = stateDir ? stateDir->GetDirectory(name.c_str()) : nullptr;
+            if (subDir) IndexDirectory(ctx, input, subDir, path, keepKeys, subStateDir);
+        }
+    }
+}
+
+// Build the key index over all inputs in one pass over their key lists. With all inputs
+// open their keys are kept for reading; in streaming mode each input is opened and closed
+// in turn, and inputs that cannot be opened are dropped.
+void BuildKeyIndex(MergeContext& ctx) {
+    bool streaming = ctx.inputFiles.empty();
+    std::vector<size_t> readable;
+    for (size_t i = 0; i < ctx.inputNames.size(); ++i) {
+        if (!streaming) {
+            IndexDirectory(ctx, i, ctx.inputFiles[i].get(), "", true, ctx.inputFiles[i]->GetDirectory(kMergeStateDir));
+            continue;
+        }
+        std::unique_ptr<TFile> file(TFile::Open(ctx.inputNames[i].c_str()));
+        if (!file || file->IsZombie()) {
+            std::cerr << "File " << ctx.inputNames[i] << " not found or is corrupted!" << std::endl;
+            ctx.stats->CountFiles(0, 1);
+            continue;
+        }
+        readable.push_back(i);
+        IndexDirectory(ctx, i, file.get(), "", false, file->GetDirectory(kMergeStateDir));
+        ctx.stats->CountFiles(1, 0);
+        ctx.stats->AddBytesRead(file->GetBytesRead());
+        file->Close();
+    }
+
+    // Drop the inputs that could not be opened
+    if (streaming && readable.size() < ctx.inputNames.size()) {
+        std::vector<std::string> names;
+        for (size_t i : readable) names.push_back(ctx.inputNames[i]);
+        for (auto& entry : ctx.entries) {
+            std::vector<char> present;
+            for (size_t i : readable) present.push_back(entry.present[i]);
+            entry.present = present;
+        }
+        ctx.inputNames = names;
+    }
+
+    // Report every object missing from some inputs once, instead of once per input
+    size_t nInputs = ctx.inputNames.size();
+    for (const auto& entry : ctx.entries) {
+        ctx.stats->CountObjects(entry.className, entry.nPresent);
+        if (entry.nPresent == nInputs || entry.kind == ObjectKind::kDirectory) continue;
+        size_t firstMissing = std::find(entry.present.begin(), entry.present.end(), 0) - entry.present.begin();
+        std::cerr << "Object " << entry.Path() << " is missing in " << nInputs - entry.nPresent << " of "
+                  << nInputs << " files (first: " << ctx.inputNames[firstMissing] << ")" << std::endl;
+    }
+}
+
+// Output directory for objects of dirPath, created on first use
+TDirectory* OutputDirectory(MergeContext& ctx, const std::string& dirPath) {
+    return dirPath.empty() ? (TDirectory*)ctx.outputFile.get() : ctx.outputFile->mkdir(dirPath.c_str(), "", true);
+}
+
+// Whether every branch in branches, and every branch below them, is compressed with
+// the given settings
+bool BranchesCompressedWith(TObjArray* branches, int compression) {
+    TIter next(branches);
+    while (TBranch* branch = (TBranch*)next()) {
+        if (branch->GetCompressionSettings() != compression) return false;
+        if (!BranchesCompressedWith(branch->GetListOfBranches(), compression)) return false;
+    }
+    return true;
+}
+
+// Whether the baskets of an input tree can be copied into the output as they are: unless
+// the output was given a compression different from the input's, or from that of one of
+// the tree's branches, which fast copies would keep
+bool CanCopyBaskets(const MergeContext& ctx, TTree* tree) {
+    if (ctx.options.compression < 0) return true;
+    if (tree->GetCurrentFile() && tree->GetCurrentFile()->GetCompressionSettings() != ctx.options.compression) return false;
+    return BranchesCompressedWith(tree->GetListOfBranches(), ctx.options.compression);
+}
+
+// Merge the tree of an entry into outputDir the way the fast mode of hadd does: the
+// first input's tree is cloned and the others are appended with CopyEntries, both in
+// "fast" mode, which copies the compressed baskets without unzipping them. Inputs that
+// are already open are reused; in streaming mode each input is opened only while its
+// tree is copied. Inputs compressed differently from a chosen output compression are
+// copied entry by entry and recompressed, in parallel when implicit multithreading is on.
+void MergeTree(MergeContext& ctx, const KeyEntry& entry, TDirectory* outputDir) {
+    auto start = std::chrono::steady_clock::now();
+    bool streaming = ctx.inputFiles.empty();
+    TTree* mergedTree = nullptr;
+    for (size_t i = 0; i < ctx.inputNames.size(); ++i) {
+        if (!entry.present[i]) continue;
+        std::unique_ptr<TFile> streamedFile;
+        std::unique_ptr<TTree> readTree; // Trees read from open inputs are ours to delete
+        TTree* tree = nullptr;
+        if (streaming) {
+            streamedFile.reset(TFile::Open(ctx.inputNames[i].c_str()));
+            if (streamedFile && !streamedFile->IsZombie()) tree = streamedFile->Get<TTree>(entry.Path().c_str());
+        } else {
+            readTree.reset((TTree*)ReadFromInput(ctx, i, entry.keys[i]));
+            tree = readTree.get();
+        }
+        if (!tree) {
+            std::cerr << "Tree " << entry.Path() << " could not be read from file " << ctx.inputNames[i] << std::endl;
+            continue;
+        }
+
+        bool fast = CanCopyBaskets(ctx, tree);
+        if (!mergedTree && fast) {
+            outputDir->cd();
+            mergedTree = tree->CloneTree(-1, "fast"); // Created in the current directory
+        } else {
+            if (!mergedTree) {
+                outputDir->cd();
+                mergedTree = tree->CloneTree(0);
+                // Branches of the clone keep the input's compression unless told otherwise
+                TIter nextBranch(mergedTree->GetListOfBranches());
+                while (TBranch* branch = (TBranch*)nextBranch()) branch->SetCompressionSettings(ctx.options.compression);
+            }
+            mergedTree->CopyEntries(tree, -1, fast ? "fast" : "", true);
+        }
+        if (streamedFile) ctx.stats->AddBytesRead(streamedFile->GetBytesRead());
+    }
+    if (mergedTree) {
+        outputDir->cd();
+        mergedTree->Write();
+        ctx.stats->AddCompression(entry.className, mergedTree->GetTotBytes(), mergedTree->GetZipBytes(), MergeStats::Seconds(start));
+        delete mergedTree; // Written; the output directory need not hold its baskets any more
+    }
+}
+
+// Copy the key of a pass-through object (canvases, metadata, ...) from the first input
+// holding it into outputDir. The compressed payload is copied byte for byte, so the
+// object is neither unzipped nor streamed. In streaming mode the input is opened here
+// and kept in source for the next objects from the same input.
+void CopyKey(MergeContext& ctx, const KeyEntry& entry, TDirectory* outputDir, std::unique_ptr<TFile>& source, size_t& sourceIndex) {
+    size_t i = std::find(entry.present.begin(), entry.present.end(), 1) - entry.present.begin();
+    if (i == entry.present.size()) return;
+
+    TKey* key = nullptr;
+    std::unique_lock<std::mutex> inputLock;
+    if (ctx.inputFiles.empty()) {
+        if (!source || sourceIndex != i) {
+            if (source) ctx.stats->AddBytesRead(source->GetBytesRead());
+            source.reset(TFile::Open(ctx.inputNames[i].c_str()));
+            sourceIndex = i;
+        }
+        if (source && !source->IsZombie()) key = GetKeyFromDirectory(source.get(), entry.dirPath, entry.name);
+    } else {
+        inputLock = std::unique_lock<std::mutex>(ctx.inputMutexes[i]);
+        key = entry.keys[i];
+    }
+    if (!key) {
+        std::cerr << "Object " << entry.Path() << " could not be read from file " << ctx.inputNames[i] << std::endl;
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(ctx.outputMutex);
+    auto start = std::chrono::steady_clock::now();
+    TKey* copy = new TKey(outputDir, *key, 0); // Reads the payload and joins the keys of outputDir
+    // Cycle 0 keeps the cycle the key was given when it joined outputDir; -1 is a failure
+    if (copy->WriteFile(0) < 0) {
+        std::cerr << "Failed to copy " << entry.Path() << " into the output" << std::endl;
+        outputDir->GetListOfKeys()->Remove(copy);
+        delete copy;
+        return;
+    }
+    ctx.stats->AddCompression(entry.className, key->GetObjlen(), key->GetNbytes() - key->GetKeylen(),
+                              MergeStats::Seconds(start));
+}
+
+// Merge all items with every input open: each item visits the inputs in turn,
+// and items are merged in parallel with the input reads serialized per file.
+void MergeItemsFromOpenFiles(MergeContext& ctx) {
+    int totalItems = ctx.items.size();
+    ForEachIndex(ctx, totalItems, [&ctx, totalItems](unsigned n) {
+        MergeItem& item = ctx.items[n];
+        const KeyEntry& entry = ctx.entries[item.entry];
+        for (size_t i = 0; i < ctx.inputFiles.size(); ++i) {
+            if (!entry.present[i]) continue; // Reported once by the key index
+            const char* fileName = ctx.inputFiles[i]->GetName();
+            auto start = std::chrono::steady_clock::now();
+            TObject* obj = ReadFromInput(ctx, i, entry.keys[i]);
+            HistogramState state;
+            bool withState = ctx.inputHasState[i] && item.kind == ObjectKind::kHistogram && obj;
+            if (withState && !GetStateFromInput(ctx, i, item, state)) {
+                std::cerr << "File " << fileName << " has no merge state for " << item.Path()
+                          << ", merged as a single replica" << std::endl;
+                withState = false;
+            }
+            item.timing.readSeconds += MergeStats::Seconds(start);
+            item.timing.bytesRead += entry.keys[i]->GetNbytes();
+            start = std::chrono::steady_clock::now();
+            FoldInput(item, obj, withState ? &state : nullptr, InputWeight(ctx.options, ctx.inputNames[i]), fileName);
+            item.timing.reduceSeconds += MergeStats::Seconds(start);
+            delete obj;
+        }
+        FinishItem(ctx, item);
+
+        std::lock_guard<std::mutex> lock(ctx.outputMutex);
+        PrintProgressBar(++ctx.nDone, totalItems);
+    });
+}
+
+// Estimated memory of an item during a streaming pass, from the uncompressed size of its
+// key: the accumulator (three doubles per cell), the quantile sketch, bootstrap sums and
+// replica contents if any and the output histogram, plus one copy per input held in the
+// read window or waiting to be scored. Cells are counted from the bin type of the class;
+// a sumw2 array makes this an overestimate.
+long long ItemFootprint(const MergeContext& ctx, const MergeItem& item) {
+    const KeyEntry& entry = ctx.entries[item.entry];
+    if (item.kind != ObjectKind::kHistogram) return 0;
+    char type = entry.className.empty() ? 'D' : entry.className.back();
+    int cellSize = type == 'D' ? 8 : type == 'F' || type == 'I' ? 4 : type == 'S' ? 2 : 1;
+    long long nCells = entry.objLen / cellSize;
+    long long sketch = item.withQuantiles ? 8 * (long long)BinQuantiles::kDefaultCapacity * nCells : 0;
+    sketch += 8 * (long long)item.nResamples * nCells;
+    if (!item.ratios.empty()) sketch += 8 * (long long)ctx.inputNames.size() * nCells;
+    if (item.withCovariance) sketch += BinCovariance::Footprint(nCells, item.covarianceBand);
+    long long nHeld = 1 + (long long)ctx.options.maxOpen;
+    if (ctx.options.outlierThreshold > 0.0) nHeld += WarmupSize(ctx.options);
+    return 3 * 8 * nCells + sketch + nHeld * entry.objLen;
+}
+
+// Split the items into passes whose estimated memory fits the budget; one pass without one
+std::vector<std::pair<size_t, size_t>> StreamingPasses(const MergeContext& ctx) {
+    long long budget = (long long)ctx.options.memoryBudgetMB << 20;
+    std::vector<std::pair<size_t, size_t>> passes;
+    size_t begin = 0;
+    long long used = 0;
+    for (size_t n = 0; n < ctx.items.size(); ++n) {
+        long long footprint = ItemFootprint(ctx, ctx.items[n]);
+        if (budget > 0 && n > begin && used + footprint > budget) {
+            passes.emplace_back(begin, n);
+            begin = n;
+            used = 0;
+        }
+        used += footprint;
+    }
+    if (begin < ctx.items.size() || passes.empty()) passes.emplace_back(begin, ctx.items.size());
+    return passes;
+}
+
+// Streaming merge: inputs are opened, read, closed and folded one after the other,
+// with the next maxOpen inputs read in the background. At most maxOpen files are open
+// and at most maxOpen + 1 inputs are held in memory (those being read and the one being
+// folded), however many inputs there are. With a
+// memory budget the items are merged in several passes over the inputs, each holding
+// the accumulators of only part of the items, which are written at the end of the pass.
+// With outlier detection every replica is scored on the first pass, just before it is
+// folded, and its weight factor applies on all passes. The first WarmupSize() replicas
+// are held and scored against each other; after them every replica is scored against
+// the running mean, even if outliers among them left fewer merged.
+void MergeItemsStreaming(MergeContext& ctx) {
+    size_t nInputs = ctx.inputNames.size();
+    std::vector<std::pair<size_t, size_t>> passes = StreamingPasses(ctx);
+    bool detectOutliers = ctx.options.outlierThreshold > 0.0;
+    ctx.inputFactors.assign(nInputs, 1.0);
+    std::vector<InputData> warmup; // Replicas waiting to be scored against each other
+    bool warmedUp = false;         // Whether the first replicas were scored
+    if (passes.size() > 1) {
+        std::cout << "Merging in " << passes.size() << " passes to stay within " << ctx.options.memoryBudgetMB
+                  << " MB" << std::endl;
+        if (detectOutliers) {
+            std::cerr << "Warning: replicas are scored with the " << passes[0].second - passes[0].first << " of "
+                      << ctx.items.size() << " histograms and parameters of the first pass only" << std::endl;
+        }
+    }
+
+    for (size_t pass = 0; pass < passes.size(); ++pass) {
+        size_t begin = passes[pass].first;
+        size_t end = passes[pass].second;
+        size_t nextInput = 0;
+        std::deque<std::future<InputData>> window;
+        auto readNext = [&]() {
+            window.push_back(std::async(std::launch::async, ReadInput, std::cref(ctx), nextInput++, begin, end));
+        };
+
+        while (window.size() < ctx.options.maxOpen && nextInput < nInputs) readNext();
+        while (!window.empty()) {
+            InputData data = window.front().get();
+            window.pop_front();
+            if (nextInput < nInputs) readNext();
+
+            if (!data.opened) {
+                if (pass == 0) std::cerr << "File " << data.fileName << " not found or is corrupted!" << std::endl;
+            } else {
+                ctx.stats->AddBytesRead(data.bytesRead);
+                if (pass > 0 || !detectOutliers || !data.states.empty()) {
+                    // Merged inputs are not scored; later passes reuse the first's scores
+                    FoldPassInput(ctx, data, begin, pass == 0);
+                } else if (ctx.nReferenceReplicas >= WarmupSize(ctx.options) ||
+                           (warmedUp && ctx.nReferenceReplicas >= MedianScorer::kMinReplicas)) {
+                    ctx.inputFactors[data.input] = JudgeReplica(ctx, data.fileName, ScoreReplica(ctx, data, begin));
+                    FoldPassInput(ctx, data, begin, true);
+                } else {
+                    // Too few replicas merged to score against: hold it back until
+                    // there are enough to compare with each other
+                    warmup.push_back(std::move(data));
+                    if (warmup.size() >= MedianScorer::kMinReplicas &&
+                        ctx.nReferenceReplicas + warmup.size() >= WarmupSize(ctx.options)) {
+                        FoldWarmup(ctx, warmup, begin);
+                        warmedUp = true;
+                    }
+                }
+            }
+            PrintProgressBar(++ctx.nDone, nInputs * passes.size());
+        }
+        FoldWarmup(ctx, warmup, begin);
+
+        for (size_t n = begin; n < end; ++n) FinishItem(ctx, ctx.items[n]);
+    }
+    std::cout << "\n"; // Newline after progress bar
+}
+
+// Keeps histograms out of the object lists of the directories while it exists, so every
+// histogram read or cloned is owned by the merger and freed as soon as it is folded or
+// written, instead of staying in its file until the file is closed
+struct NoHistogramDirectory {
+    bool previous = TH1::AddDirectoryStatus();
+    NoHistogramDirectory() { TH1::AddDirectory(false); }
+    ~NoHistogramDirectory() { TH1::AddDirectory(previous); }
+};
+
+// Implicit multithreading on nThreads threads while in scope, unless it is already on or
+// nThreads is 1; only turned off again if it was turned on here
+struct ImplicitMTScope {
+    bool enabled = false;
+    explicit ImplicitMTScope(unsigned nThreads) {
+        if (nThreads == 1 || ROOT::IsImplicitMTEnabled()) return;
+        ROOT::EnableImplicitMT(nThreads);
+        enabled = true;
+    }
+    ~ImplicitMTScope() {
+        if (enabled) ROOT::DisableImplicitMT();
+    }
+};
+
+// Function to merge the given input files into one output file.
+// Returns false if nothing could be merged.
+bool MergeInputs(const std::vector<std::string>& inputNames, const std::string& outputFileName, const MergeOptions& options,
+                 MergeStats* stats) {
+    MergeContext ctx;
+    ctx.options = options;
+    ctx.inputNames = inputNames;
+    if (ctx.options.outlierThreshold > 0.0 && ctx.options.maxOpen == 0) {
+        // Replicas are scored against the running mean, input after input
+        std::cerr << "Outlier detection streams through the inputs and needs --max-open" << std::endl;
+        return false;
+    }
+    bool streaming = ctx.options.maxOpen > 0;
+    MergeStats localStats;
+    ctx.stats = stats ? stats : &localStats;
+
+    // ROOT needs its global state protected before files are used from several threads;
+    // when streaming, inputs are always read on a background thread
+    if (ctx.options.nThreads != 1 || ctx.options.maxOpen > 0) ROOT::EnableThreadSafety();
+    NoHistogramDirectory noDirectory;
+
+    // With threads, ROOT also compresses the baskets of the output trees in parallel
+    ImplicitMTScope implicitMT(ctx.options.nThreads);
+
+    // Without streaming, every input is opened up front
+    if (!streaming) {
+        MergeStats::PhaseTimer timer(*ctx.stats, "open inputs");
+        std::vector<std::string> opened;
+        for (const auto& fileName : ctx.inputNames) {
+            std::unique_ptr<TFile> file(TFile::Open(fileName.c_str()));
+            if (file && !file->IsZombie()) {
+                std::cout << "File " << fileName << " is found and opened successfully." << std::endl;
+                ctx.stats->CountFiles(1, 0);
+                opened.push_back(fileName);
+                ctx.inputHasState.push_back(file->GetDirectory(kMergeStateDir) != nullptr);
+                AppendToManifest(ctx.manifest, file.get(), fileName, ctx.inputHasState.back());
+                ctx.inputFiles.push_back(std::move(file));
+            } else {
+                std::cerr << "File " << fileName << " not found or is corrupted!" << std::endl;
+                ctx.stats->CountFiles(0, 1);
+            }
+        }
+        ctx.inputNames = opened;
+    }
+
+    ctx.inputMutexes = std::vector<std::mutex>(ctx.inputFiles.size());
+
+    // One pass over the key lists of all inputs finds every object to merge
+    {
+        MergeStats::PhaseTimer timer(*ctx.stats, "index keys");
+        BuildKeyIndex(ctx);
+    }
+
+    // Number of files to merge
+    int nFiles = ctx.inputNames.size();
+
+    // Proceed with merging if at least one file is found
+    if (nFiles < 1) {
+        std::cerr << "No files found for merging." << std::endl;
+        return false;
+    }
+    if (ctx.entries.empty()) {
+        std::cerr << "No objects found in the input files." << std::endl;
+        return false;
+    }
+
+    // Create the output file
+    if (ctx.options.compression >= 0) {
+        ctx.outputFile.reset(new TFile(outputFileName.c_str(), "RECREATE", "", ctx.options.compression));
+    } else {
+        ctx.outputFile.reset(new TFile(outputFileName.c_str(), "RECREATE"));
+    }
+    if (ctx.outputFile->IsZombie()) {
+        std::cerr << "Failed to create the output file " << outputFileName << std::endl;
+        return false;
+    }
+
+    std::cout << "Merging " << nFiles << " files into " << outputFileName << " ("
+              << BinKernels::IsaName(BinKernels::DetectIsa()) << " bin kernels, "
+              << CompressionName(ctx.outputFile->GetCompressionSettings()) << " compression)..." << std::endl;
+    ctx.stats->SetOutputCompression(CompressionName(ctx.outputFile->GetCompressionSettings()));
+
+    // Create the output directories and write trees and other objects right away;
+    // histograms and parameters are collected as items.
+    MergeDirectories(ctx);
+    SetUpRatios(ctx);
+
+    // Merge the histograms and parameters, in parallel if requested
+    MergeStats::PhaseTimer mergeTimer(*ctx.stats, "merge histograms and parameters");
+    if (ctx.options.nThreads != 1) {
+        ctx.pool.reset(new ROOT::TThreadExecutor(ctx.options.nThreads));
+        for (auto& item : ctx.items) item.pool = ctx.pool.get();
+        std::cout << "Merging " << ctx.items.size() << " histograms and parameters on "
+                  << ctx.pool->GetPoolSize() << " threads" << std::endl;
+    }
+    if (streaming) {
+        MergeItemsStreaming(ctx);
+    } else {
+        MergeItemsFromOpenFiles(ctx);
+        std::cout << "\n"; // Newline after progress bar
+    }
+    mergeTimer.Stop();
+    if (ctx.options.outlierThreshold > 0.0) {
+        // Including those of merged inputs, whose lines end with their factor
+        size_t nOutliers = std::count_if(ctx.replicaScores.begin(), ctx.replicaScores.end(), [](const std::string& line) {
+            return std::stod(line.substr(line.rfind('\t') + 1)) < 1.0;
+        });
+        std::cout << nOutliers << " of " << ctx.replicaScores.size() << " replicas scored were outliers" << std::endl;
+        WriteReplicaScores(ctx);
+
+        // Trees and other objects of a left-out replica are left out too
+        for (size_t i = 0; i < ctx.inputFactors.size(); ++i) {
+            if (ctx.inputFactors[i] > 0.0) continue;
+            for (auto& entry : ctx.entries) {
+                if (!entry.present[i]) continue;
+                entry.present[i] = 0;
+                --entry.nPresent;
+            }
+        }
+        WritePassThrough(ctx, ctx.deferredEntries);
+    }
+    for (auto& job : ctx.ratios) {
+        if (job.nReady == 2) continue;
+        std::cerr << "Ratio " << job.name << " not written: an operand could not be merged" << std::endl;
+        delete job.shape;
+    }
+
+    // Close all files; closing the output flushes what is still buffered
+    MergeStats::PhaseTimer closeTimer(*ctx.stats, "close files");
+    if (ctx.options.keepState) WriteManifest(ctx);
+    for (auto& file : ctx.inputFiles) {
+        ctx.stats->AddBytesRead(file->GetBytesRead());
+        file->Close();
+    }
+    ctx.outputFile->Close();
+    ctx.stats->AddBytesWritten(ctx.outputFile->GetBytesWritten());
+    return true;
+}
+
+// Name of the partial file of one group, e.g. "PairGenMerged.part3.root"
+std::string PartialFileName(const std::string& outputFileName, unsigned group) {
+    std::string stem = fs::path(outputFileName).replace_extension().string();
+    return stem + ".part" + std::to_string(group) + ".root";
+}
+
+// Partial files of an earlier --groups run next to the output, in group order
+std::vector<std::string> FindPartialFiles(const std::string& outputFileName) {
+    fs::path outputPath(outputFileName);
+    fs::path dir = outputPath.has_parent_path() ? outputPath.parent_path() : fs::path(".");
+    std::string prefix = outputPath.stem().string() + ".part";
+
+    std::vector<std::pair<unsigned long, std::string>> found;
+    for (const auto& entry : fs::directory_iterator(dir)) {
+        // Accept <prefix><digits>.root only
+        std::string name = entry.path().filename().string();
+        if (!entry.is_regular_file() || name.size() <= prefix.size() + 5 ||
+            name.compare(0, prefix.size(), prefix) != 0 || name.substr(name.size() - 5) != ".root") continue;
+        std::string index = name.substr(prefix.size(), name.size() - prefix.size() - 5);
+        if (index.find_first_not_of("0123456789") != std::string::npos) continue;
+        found.emplace_back(std::stoul(index), entry.path().string());
+    }
+    std::sort(found.begin(), found.end());
+
+    std::vector<std::string> partialNames;
+    for (const auto& f : found) partialNames.push_back(f.second);
+    return partialNames;
+}
+
+// Hierarchical merge. The inputs are split into nGroups contiguous groups; each group is
+// merged into a partial file carrying its per-bin state (the map step, one process per
+// group), and the partial files are then combined into the output (the reduce step),
+// which only has to merge nGroups accumulators per bin. With --group-index only that
+// group's partial file is written, so the map steps can run in separate batch slots and
+// be combined later with --reduce.
+bool MergeGroups(const std::vector<std::string>& inputNames, const std::string& outputFileName, const MergeOptions& options,
+                 MergeStats* stats) {
+    unsigned nGroups = options.nGroups;
+    MergeOptions mapOptions = options;
+    mapOptions.keepState = true;
+
+    auto mapGroup = [&](unsigned group) -> int {
+        size_t begin = inputNames.size() * group / nGroups;
+        size_t end = inputNames.size() * (group + 1) / nGroups;
+        if (begin == end) return 1; // More groups than inputs
+        std::vector<std::string> groupNames(inputNames.begin() + begin, inputNames.begin() + end);
+        return MergeInputs(groupNames, PartialFileName(outputFileName, group), mapOptions,
+                           options.groupIndex >= 0 ? stats : nullptr) ? 1 : 0;
+    };
+
+    if (options.groupIndex >= 0) return mapGroup(options.groupIndex);
+
+    // Map: each group is merged in a forked worker process
+    unsigned nWorkers = std::min(nGroups, std::max(1u, std::thread::hardware_concurrency()));
+    std::cout << "Merging " << inputNames.size() << " files in " << nGroups << " groups on "
+              << nWorkers << " processes" << std::endl;
+    // The workers' own timers stay in their processes, only the wall time is recorded
+    auto start = std::chrono::steady_clock::now();
+    ROOT::TProcessExecutor workers(nWorkers);
+    std::vector<int> groupOk = workers.Map(mapGroup, ROOT::TSeqU(nGroups));
+    if (stats) stats->AddPhase("merge groups", MergeStats::Seconds(start));
+    for (unsigned group = 0; group < nGroups; ++group) {
+        if (!groupOk[group]) {
+            std::cerr << "Merging group " << group << " failed" << std::endl;
+            return false;
+        }
+    }
+
+    // Reduce: combine the partial files of this run and remove them
+    std::vector<std::string> partialNames;
+    for (unsigned group = 0; group < nGroups; ++group) {
+        std::string name = PartialFileName(outputFileName, group);
+        if (fs::exists(name)) partialNames.push_back(name);
+    }
+    bool ok = MergeInputs(partialNames, outputFileName, options, stats);
+    for (const auto& name : partialNames) fs::remove(name);
+    return ok;
+}
+
+// Run body(i) for i in [0, n) on up to nThreads threads
+template <typename F>
+void ParallelFor(size_t n, unsigned nThreads, F body) {
+    nThreads = (unsigned)std::max<size_t>(1, std::min<size_t>(nThreads, n));
+    std::atomic<size_t> next{0};
+    auto work = [&]() {
+        for (size_t i; (i = next++) < n;) body(i);
+    };
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < nThreads; ++t) threads.emplace_back(work);
+    work();
+    for (auto& thread : threads) thread.join();
+}
+
+// Natural order of file names: runs of digits are compared by value, so "rep_9" comes
+// before "rep_10"
+bool NaturalLess(const std::string& a, const std::string& b) {
+    size_t i = 0, j = 0;
+    while (i < a.size() && j < b.size()) {
+        if (std::isdigit((unsigned char)a[i]) && std::isdigit((unsigned char)b[j])) {
+            size_t endA = a.find_first_not_of("0123456789", i);
+            size_t endB = b.find_first_not_of("0123456789", j);
+            if (endA == std::string::npos) endA = a.size();
+            if (endB == std::string::npos) endB = b.size();
+            // Compare the values without leading zeros: longer is larger, else by digits
+            size_t startA = std::min(a.find_first_not_of('0', i), endA);
+            size_t startB = std::min(b.find_first_not_of('0', j), endB);
+            if (endA - startA != endB - startB) return endA - startA < endB - startB;
+            int cmp = a.compare(startA, endA - startA, b, startB, endB - startB);
+            if (cmp != 0) return cmp < 0;
+            if (endA - i != endB - j) return endA - i < endB - j; // Fewer leading zeros first
+            i = endA;
+            j = endB;
+        } else {
+            if (a[i] != b[j]) return a[i] < b[j];
+            ++i;
+            ++j;
+        }
+    }
+    return a.size() - i < b.size() - j;
+}
+
+// Paths below base matching one pattern component: files if last, else directories.
+// "**" matches base itself and all directories below it (or all files below it if last),
+// leaving out hidden ones like the other wildcards do.
+std::vector<fs::path> MatchComponent(const fs::path& base, const std::string& comp, bool last) {
+    std::vector<fs::path> found;
+    std::error_code ec;
+    if (comp == "**") {
+        if (!last) found.push_back(base);
+        for (fs::recursive_directory_iterator it(base, fs::directory_options::skip_permission_denied, ec), end;
+             it != end; it.increment(ec)) {
+            if (it->path().filename().string()[0] == '.') {
+                it.disable_recursion_pending();
+                continue;
+            }
+            if (last ? it->is_regular_file(ec) : it->is_directory(ec)) found.push_back(it->path());
+        }
+        return found;
+    }
+
+    // Components without wildcards are taken literally
+    if (comp.find_first_of("*?[") == std::string::npos) {
+        fs::path path = base / comp;
+        if (last ? fs::is_regular_file(path, ec) : fs::is_directory(path, ec)) found.push_back(path);
+        return found;
+    }
+    for (const auto& entry : fs::directory_iterator(base, ec)) {
+        std::string name = entry.path().filename().string();
+        if (fnmatch(comp.c_str(), name.c_str(), FNM_PERIOD) != 0) continue;
+        if (last ? entry.is_regular_file(ec) : entry.is_directory(ec)) found.push_back(entry.path());
+    }
+    return found;
+}
+
+// Files matching a glob pattern such as "*/PairGen.root" or "runs/**/PairGen.root".
+// Every path component may use the wildcards of fnmatch(), and "**" stands for any
+// number of directories; the last component names files, the others directories. The
+// directories matched so far are scanned in parallel, which pays off on network file
+// systems, and the result is sorted so that it does not depend on the scan order.
+std::vector<std::string> DiscoverInputs(const std::string& pattern, unsigned nThreads) {
+    std::vector<std::string> components;
+    std::istringstream in(pattern);
+    std::string component;
+    while (std::getline(in, component, '/')) {
+        if (!component.empty()) components.push_back(component);
+    }
+
+    std::vector<fs::path> matches{!pattern.empty() && pattern[0] == '/' ? fs::path("/") : fs::path(".")};
+    for (size_t c = 0; c < components.size(); ++c) {
+        bool last = c + 1 == components.size();
+        std::vector<std::vector<fs::path>> found(matches.size());
+        ParallelFor(matches.size(), nThreads, [&](size_t i) {
+            found[i] = MatchComponent(matches[i], components[c], last);
+        });
+        std::vector<fs::path> next;
+        for (const auto& paths : found) next.insert(next.end(), paths.begin(), paths.end());
+        matches = next;
+    }
+
+    // "**" can reach a directory along several paths
+    std::set<std::string> unique;
+    for (const auto& path : matches) unique.insert(path.lexically_normal().string());
+    std::vector<std::string> inputNames;
+    for (const auto& path : matches) {
+        if (unique.erase(path.lexically_normal().string())) inputNames.push_back(path.string());
+    }
+    std::sort(inputNames.begin(), inputNames.end(), NaturalLess);
+    return inputNames;
+}
+
+// Open every input, on up to nThreads threads, and keep those that open cleanly and hold
+// objects. Files that were not closed properly (recovered by ROOT) are kept with a warning.
+std::vector<std::string> ValidateInputs(const std::vector<std::string>& inputNames, unsigned nThreads) {
+    if (nThreads > 1) ROOT::EnableThreadSafety();
+    std::vector<std::string> problems(inputNames.size());
+    std::vector<char> usable(inputNames.size(), 0);
+    ParallelFor(inputNames.size(), nThreads, [&](size_t i) {
+        std::unique_ptr<TFile> file(TFile::Open(inputNames[i].c_str()));
+        if (!file || file->IsZombie()) {
+            problems[i] = "cannot be opened or is corrupted";
+        } else if (file->GetNkeys() == 0) {
+            problems[i] = "holds no objects";
+        } else {
+            usable[i] = 1;
+            if (file->TestBit(TFile::kRecovered)) problems[i] = "was not closed properly, merged as recovered";
+        }
+    });
+
+    std::vector<std::string> goodNames;
+    std::vector<std::string> report;
+    size_t nBad = 0;
+    for (size_t i = 0; i < inputNames.size(); ++i) {
+        if (usable[i]) goodNames.push_back(inputNames[i]);
+        if (!usable[i]) ++nBad;
+        if (!problems[i].empty()) report.push_back(inputNames[i] + " " + problems[i]);
+    }
+    if (!report.empty()) {
+        const size_t kMaxListed = 20;
+        std::cerr << nBad << " of " << inputNames.size() << " input files are skipped";
+        if (report.size() > nBad) std::cerr << ", " << report.size() - nBad << " were recovered";
+        std::cerr << ":" << std::endl;
+        for (size_t k = 0; k < report.size() && k < kMaxListed; ++k) std::cerr << "  " << report[k] << std::endl;
+        if (report.size() > kMaxListed) std::cerr << "  ... and " << report.size() - kMaxListed << " more" << std::endl;
+    }
+    return goodNames;
+}
+
+// Minimal reader of the JSON input lists: strings, numbers, objects and arrays,
+// without escapes other than \" and \\ in strings
+struct JsonReader {
+    std::string text;
+    size_t pos = 0;
+
+    bool Next(char c) {
+        while (pos < text.size() && std::isspace((unsigned char)text[pos])) ++pos;
+        if (pos < text.size() && text[pos] == c) {
+            ++pos;
+            return true;
+        }
+        return false;
+    }
+    bool AtEnd() {
+        while (pos < text.size() && std::isspace((unsigned char)text[pos])) ++pos;
+        return pos == text.size();
+    }
+    bool String(std::string& value) {
+        if (!Next('"')) return false;
+        value.clear();
+        for (; pos < text.size() && text[pos] != '"'; ++pos) {
+            if (text[pos] == '\\' && pos + 1 < text.size()) ++pos;
+            value += text[pos];
+        }
+        return pos++ < text.size();
+    }
+    // A number, string, true, false or null as text
+    bool Scalar(std::string& value) {
+        if (AtEnd()) return false;
+        if (text[pos] == '"') return String(value);
+        size_t end = text.find_first_of(",}] \t\r\n", pos);
+        if (end == std::string::npos) end = text.size();
+        value = text.substr(pos, end - pos);
+        pos = end;
+        return !value.empty();
+    }
+};
+
+// Read one input of a JSON list: a file name or {"file": ..., "weight": ..., "label": ...}
+bool ReadJsonInput(JsonReader& json, InputSpec& input) {
+    if (!json.Next('{')) return json.String(input.fileName);
+    if (json.Next('}')) return false;
+    do {
+        std::string key, value;
+        if (!json.String(key) || !json.Next(':') || !json.Scalar(value)) return false;
+        if (key == "file" || key == "path") {
+            input.fileName = value;
+        } else if (key == "weight") {
+            try {
+                input.weight = std::stod(value);
+            } catch (const std::exception&) {
+                return false;
+            }
+        } else if (key == "label") {
+            input.label = value;
+        }
+    } while (json.Next(','));
+    return json.Next('}') && !input.fileName.empty();
+}
+
+// Read a JSON input list: an array of inputs, or an object holding it as "inputs"
+bool ReadJsonInputList(const std::string& text, std::vector<InputSpec>& inputs) {
+    JsonReader json{text};
+    bool wrapped = json.Next('{');
+    if (wrapped) {
+        std::string key;
+        if (!json.String(key) || key != "inputs" || !json.Next(':')) return false;
+    }
+    if (!json.Next('[')) return false;
+    if (!json.Next(']')) {
+        do {
+            InputSpec input;
+            if (!ReadJsonInput(json, input)) return false;
+            inputs.push_back(input);
+        } while (json.Next(','));
+        if (!json.Next(']')) return false;
+    }
+    return (!wrapped || json.Next('}')) && json.AtEnd();
+}
+
+// Read a text input list: "file [weight] [label]" per line. A number right after the
+// file, or "weight=X" anywhere before the label, gives the weight; a line with two
+// weights is rejected. The other words make up the label, and so does everything after
+// "label=", taken as it is.
+bool ReadTextInputList(const std::string& text, std::vector<InputSpec>& inputs) {
+    std::istringstream lines(text);
+    std::string line;
+    for (int lineNumber = 1; std::getline(lines, line); ++lineNumber) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream words(line);
+        InputSpec input;
+        if (!(words >> input.fileName)) continue;
+        bool hasWeight = false;
+        bool first = true;
+        for (std::string word; words >> word; first = false) {
+            if (word.compare(0, 6, "label=") == 0) {
+                // The rest of the line, numbers included
+                std::string rest = word.substr(6);
+                std::string tail;
+                if (std::getline(words, tail)) rest += tail;
+                rest.erase(rest.find_last_not_of(" \t\r") + 1);
+                input.label += (input.label.empty() || rest.empty() ? "" : " ") + rest;
+                break;
+            }
+            bool isWeight = word.compare(0, 7, "weight=") == 0;
+            std::string value = isWeight ? word.substr(7) : word;
+            size_t used = 0;
+            double weight = 0.0;
+            try {
+                weight = std::stod(value, &used);
+            } catch (const std::exception&) {
+            }
+            bool isNumber = !value.empty() && used == value.size();
+            if (isWeight && !isNumber) {
+                std::cerr << "Line " << lineNumber << ": bad weight " << value << std::endl;
+                return false;
+            }
+            if (isWeight || (first && isNumber)) {
+                if (hasWeight) {
+                    std::cerr << "Line " << lineNumber << ": more than one weight for " << input.fileName << std::endl;
+                    return false;
+                }
+                input.weight = weight;
+                hasWeight = true;
+            } else {
+                input.label += (input.label.empty() ? "" : " ") + word;
+            }
+        }
+        inputs.push_back(input);
+    }
+    return true;
+}
+
+bool ReadInputList(const std::string& listFileName, std::vector<InputSpec>& inputs) {
+    std::ifstream in(listFileName);
+    if (!in) {
+        std::cerr << "Cannot read the input list " << listFileName << std::endl;
+        return false;
+    }
+    std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    // A list starting with "[" or "{" is JSON, anything else text
+    size_t first = text.find_first_not_of(" \t\r\n");
+    bool isJson = first != std::string::npos && (text[first] == '[' || text[first] == '{');
+    std::vector<InputSpec> listed;
+    if (!(isJson ? ReadJsonInputList(text, listed) : ReadTextInputList(text, listed))) {
+        std::cerr << "Malformed input list " << listFileName << std::endl;
+        return false;
+    }
+
+    // Names are relative to the list; an input listed twice is merged once
+    fs::path listDir = fs::path(listFileName).parent_path();
+    std::set<std::string> seen;
+    for (auto& input : listed) {
+        if (!(input.weight >= 0.0)) {
+            std::cerr << "Input " << input.fileName << " in " << listFileName << " has a negative weight" << std::endl;
+            return false;
+        }
+        input.fileName = (listDir / input.fileName).lexically_normal().string();
+        if (!seen.insert(input.fileName).second) {
+            std::cerr << "Input " << input.fileName << " is listed twice in " << listFileName << ", merged once" << std::endl;
+            continue;
+        }
+        inputs.push_back(input);
+    }
+    return true;
+}
+
+// 64-bit FNV-1a hash of a file's content, taken over 8-byte words; empty if unreadable
+std::string HashFile(const std::string& fileName) {
+    std::ifstream in(fileName, std::ios::binary);
+    if (!in) return "";
+    const size_t kChunk = 1 << 20;
+    std::vector<char> buffer(kChunk);
+    unsigned long long hash = 14695981039346656037ull;
+    while (in) {
+        in.read(buffer.data(), kChunk);
+        size_t n = in.gcount();
+        for (size_t i = 0; i < n; i += 8) {
+            unsigned long long word = 0;
+            std::memcpy(&word, buffer.data() + i, std::min<size_t>(8, n - i));
+            hash = (hash ^ word) * 1099511628211ull;
+        }
+    }
+    char text[17];
+    std::snprintf(text, sizeof(text), "%016llx", hash);
+    return text;
+}
+
+// Settings of a merge that change its output, apart from the inputs
+std::string MergeSettings(const MergeOptions& opts) {
+    std::ostringstream settings;
+    settings << "policy=" << (int)opts.errorPolicy << " compression=" << opts.compression
+             << " keep-state=" << opts.keepState << " quantiles=";
+    for (double level : opts.quantiles) settings << level << ",";
+    settings << " bootstrap=" << opts.bootstrap << " seed=" << opts.bootstrapSeed << " levels=";
+    for (double level : opts.bootstrapLevels) settings << level << ",";
+    settings << " jackknife=" << opts.jackknife << " ratios=" << opts.jackknifeRatioFileName;
+    if (!opts.jackknifeRatioFileName.empty()) settings << ":" << HashFile(opts.jackknifeRatioFileName);
+    settings << " covariance=";
+    for (const auto& pattern : opts.covariancePatterns) settings << pattern << ",";
+    settings << " band=" << opts.covarianceBand << " outliers=" << opts.outlierThreshold
+             << (opts.outlierDownweight ? ":downweight" : ":exclude") << ":" << opts.outlierWarmup;
+    return settings.str();
+}
+
+// Read the record of the inputs and settings of a merged output; false if it has none
+bool ReadMergeRecord(const std::string& fileName, std::vector<std::string>& inputLines, std::string& settings) {
+    std::unique_ptr<TFile> file(TFile::Open(fileName.c_str()));
+    if (!file || file->IsZombie()) return false;
+    std::unique_ptr<TList> list((TList*)file->Get((std::string(kMergeInfoDir) + "/" + kManifestName).c_str()));
+    std::unique_ptr<TObjString> stored((TObjString*)file->Get((std::string(kMergeInfoDir) + "/" + kSettingsName).c_str()));
+    if (!list || !stored) return false;
+    list->SetOwner();
+    TIter next(list.get());
+    while (TObject* entry = next()) inputLines.push_back(entry->GetName());
+    settings = stored->GetName();
+    return true;
+}
+
+// One record line per input, "name<TAB>size<TAB>mtime<TAB>weight<TAB>label". Only the
+// file's metadata is looked up, on up to nThreads threads, so fingerprinting never reads
+// the inputs themselves.
+std::vector<std::string> FingerprintInputs(const std::vector<std::string>& inputNames, const MergeOptions& opts) {
+    std::vector<std::string> lines(inputNames.size());
+    ParallelFor(inputNames.size(), opts.nOpenThreads, [&](size_t i) {
+        std::error_code ec;
+        std::ostringstream line;
+        auto label = opts.inputLabels.find(inputNames[i]);
+        line << fs::path(inputNames[i]).lexically_normal().string() << "\t" << fs::file_size(inputNames[i], ec) << "\t"
+             << (long long)fs::last_write_time(inputNames[i], ec).time_since_epoch().count() << "\t"
+             << InputWeight(opts, inputNames[i]) << "\t" << (label != opts.inputLabels.end() ? label->second : "");
+        lines[i] = line.str();
+    });
+    return lines;
+}
+
+// Record the inputs and settings of a merge in its output
+bool WriteMergeRecord(const std::string& fileName, const std::vector<std::string>& inputLines, const std::string& settings) {
+    std::unique_ptr<TFile> file(TFile::Open(fileName.c_str(), "UPDATE"));
+    if (!file || file->IsZombie()) return false;
+    TList list;
+    list.SetOwner();
+    for (const auto& line : inputLines) list.Add(new TObjString(line.c_str()));
+    TObjString stored(settings.c_str());
+    TDirectory* infoDir = file->mkdir(kMergeInfoDir, "", true);
+    infoDir->WriteTObject(&list, kManifestName, "Overwrite");
+    infoDir->WriteTObject(&stored, kSettingsName, "Overwrite");
+    file->Close();
+    return true;
+}
+
+// Steps of RunMerge(), adding their timers and counters to stats
+bool RunMergeSteps(const MergeOptions& options, MergeStats& stats) {
+    MergeOptions opts = options;
+    const std::string& outputFileName = opts.outputFileName;
+
+    std::vector<std::string> inputNames;
+    {
+        MergeStats::PhaseTimer timer(stats, "discover inputs");
+        if (opts.reduce) {
+            inputNames = FindPartialFiles(outputFileName);
+        } else if (!opts.inputListFileName.empty()) {
+            std::vector<InputSpec> inputs;
+            if (!ReadInputList(opts.inputListFileName, inputs)) return false;
+            for (const auto& input : inputs) {
+                inputNames.push_back(input.fileName);
+                opts.inputWeights[input.fileName] = input.weight;
+                if (!input.label.empty()) opts.inputLabels[input.fileName] = input.label;
+            }
+        } else {
+            // Find the replica files, by default the PairGen.root of every subdirectory
+            inputNames = DiscoverInputs(opts.inputPattern, opts.nOpenThreads);
+        }
+    }
+    if (!inputNames.empty()) {
+        MergeStats::PhaseTimer timer(stats, "validate inputs");
+        std::cout << "Checking " << inputNames.size() << " input files..." << std::endl;
+        inputNames = ValidateInputs(inputNames, opts.nOpenThreads);
+    }
+
+    // Proceed with merging if at least one file is found
+    if (inputNames.empty()) {
+        std::cerr << "No files found for merging." << std::endl;
+        return false;
+    }
+
+    // Compare the inputs with the record of the existing output: if nothing changed the
+    // merge is skipped, and if inputs were only added to an output with a saved state
+    // just those are merged into it. A map step or a reduce of partial files is not
+    // recorded.
+    bool recorded = opts.groupIndex < 0 && !opts.reduce;
+    std::vector<std::string> recordLines;
+    std::string settings = MergeSettings(opts);
+    if (recorded) {
+        MergeStats::PhaseTimer timer(stats, "fingerprint inputs");
+        std::vector<std::string> previousLines;
+        std::string previousSettings;
+        bool hasRecord = fs::exists(outputFileName) && ReadMergeRecord(outputFileName, previousLines, previousSettings);
+        recordLines = FingerprintInputs(inputNames, opts);
+        if (hasRecord && !opts.force && previousSettings == settings) {
+            std::set<std::string> current(recordLines.begin(), recordLines.end());
+            bool unchanged = std::all_of(previousLines.begin(), previousLines.end(),
+                                         [&](const std::string& line) { return current.count(line) > 0; });
+            if (unchanged && previousLines.size() == recordLines.size()) {
+                std::cout << outputFileName << " is up to date with its " << recordLines.size()
+                          << " inputs; nothing to merge (use --force to merge anyway)." << std::endl;
+                return true;
+            }
+            if (unchanged && opts.keepState && !opts.incremental) {
+                std::cout << "Inputs were only added since " << outputFileName
+                          << " was merged; merging the new ones into it." << std::endl;
+                opts.incremental = true;
+            }
+        }
+
+        // An input that changed under the same name (size, time, weight or label)
+        // is in the output with its old content, so only a full merge brings it up to date
+        if (hasRecord && opts.incremental) {
+            std::unordered_map<std::string, std::string> previousLine;
+            for (const auto& line : previousLines) previousLine[line.substr(0, line.find('\t'))] = line;
+            size_t nChanged = 0;
+            std::string firstChanged;
+            for (const auto& line : recordLines) {
+                auto found = previousLine.find(line.substr(0, line.find('\t')));
+                if (found == previousLine.end() || found->second == line) continue;
+                if (nChanged++ == 0) firstChanged = found->first;
+            }
+            if (nChanged > 0) {
+                std::cout << nChanged << " inputs changed since " << outputFileName << " was merged (e.g. "
+                          << firstChanged << "); merging all inputs again." << std::endl;
+                opts.incremental = false;
+            }
+        }
+    }
+
+    // Incremental merge: the existing output is set aside and merged, through its saved
+    // state, with the inputs that are not yet in its manifest. Replicas its outlier
+    // detection left out are not in the manifest but count as done, so they are neither
+    // read nor scored again.
+    std::string previousFileName;
+    if (opts.incremental && fs::exists(outputFileName)) {
+        std::vector<std::string> merged;
+        std::vector<std::string> scores;
+        std::unique_ptr<TFile> previous(TFile::Open(outputFileName.c_str()));
+        if (!previous || previous->IsZombie() || !ReadManifest(previous.get(), merged)) {
+            std::cerr << "File " << outputFileName << " has no merge state; merge once with --keep-state first" << std::endl;
+            return false;
+        }
+        ReadReplicaScores(previous.get(), scores);
+        previous->Close();
+
+        std::set<std::string> done(merged.begin(), merged.end());
+        size_t nLeftOut = 0;
+        for (const auto& line : scores) {
+            if (std::stod(line.substr(line.rfind('\t') + 1)) > 0.0) continue;
+            if (done.insert(line.substr(0, line.find('\t'))).second) ++nLeftOut;
+        }
+        std::vector<std::string> newNames;
+        for (const auto& name : inputNames) {
+            if (!done.count(fs::path(name).lexically_normal().string())) newNames.push_back(name);
+        }
+        if (newNames.empty()) {
+            std::cout << outputFileName << " is up to date with " << merged.size() << " merged files and "
+                      << nLeftOut << " left out." << std::endl;
+            return true;
+        }
+        std::cout << "Adding " << newNames.size() << " new files to the " << merged.size()
+                  << " already merged into " << outputFileName << " (" << nLeftOut << " left out)" << std::endl;
+
+        previousFileName = outputFileName + ".previous";
+        fs::rename(outputFileName, previousFileName);
+        inputNames = newNames;
+        inputNames.insert(inputNames.begin(), previousFileName);
+    }
+
+    bool ok = opts.nGroups > 0 && !opts.reduce ? MergeGroups(inputNames, outputFileName, opts, &stats)
+                                               : MergeInputs(inputNames, outputFileName, opts, &stats);
+
+    // Drop the previous output once the new one is written, or put it back
+    if (!previousFileName.empty()) {
+        if (ok) {
+            fs::remove(previousFileName);
+        } else {
+            fs::rename(previousFileName, outputFileName);
+        }
+    }
+    if (ok && recorded && !WriteMergeRecord(outputFileName, recordLines, settings)) {
+        std::cerr << "Failed to record the inputs in " << outputFileName << std::endl;
+    }
+    if (ok) std::cout << "Merging completed successfully." << std::endl;
+    return ok;
+}
+
+// Merge the inputs selected by the options (see MergeUsage()) into the output file. The
+// report is written however the merge ends, including when there is nothing to merge.
+bool RunMerge(const MergeOptions& options) {
+    MergeStats stats;
+    stats.SetRecordObjects(options.reportObjects);
+    auto start = std::chrono::steady_clock::now();
+    bool ok = RunMergeSteps(options, stats);
+
+    if (!options.reportFileName.empty()) {
+        if (stats.WriteJson(options.reportFileName, MergeStats::Seconds(start))) {
+            std::cout << "Merge report written to " << options.reportFileName << std::endl;
+        } else {
+            std::cerr << "Failed to write the merge report " << options.reportFileName << std::endl;
+        }
+    }
+    return ok;
+}
+
+// Function to create the output directories and merge the objects of the key index.
+// Trees and other objects are written right away, or with outlier detection once the
+// outliers are known; histograms and parameters are collected in ctx.items and merged
+// once the whole directory tree of the output exists.
+void MergeDirectories(MergeContext& ctx) {
+    std::vector<size_t> passThrough; // Trees and other objects
+    for (size_t n = 0; n < ctx.entries.size(); ++n) {
+        KeyEntry& entry = ctx.entries[n];
+        std::string objName = entry.name;
+        TDirectory* outputDir = OutputDirectory(ctx, entry.dirPath);
+
+        // Process the object depending on its type
+        if (entry.kind == ObjectKind::kHistogram || entry.kind == ObjectKind::kParameter) {
+            MergeItem item;
+            item.kind = entry.kind;
+            item.entry = n;
+            item.dirPath = entry.dirPath;
+            item.name = objName;
+            item.outputDir = outputDir;
+            item.withQuantiles = entry.kind == ObjectKind::kHistogram && !ctx.options.quantiles.empty();
+            item.nResamples = entry.kind == ObjectKind::kHistogram ? ctx.options.bootstrap : 0;
+            item.bootstrapSeed = ctx.options.bootstrapSeed;
+            for (const auto& pattern : ctx.options.covariancePatterns) {
+                if (entry.kind == ObjectKind::kHistogram && fnmatch(pattern.c_str(), entry.Path().c_str(), 0) == 0) {
+                    item.withCovariance = true;
+                }
+            }
+            item.covarianceBand = ctx.options.covarianceBand;
+            // A histogram's output object is its first input copy, taken over while merging
+            if (entry.kind == ObjectKind::kParameter) {
+                // It's a parameter: its reduction is looked up once for all inputs
+                item.foldParameter = FindParameterFold(TClass::GetClass(entry.className.c_str()));
+            }
+            ctx.items.push_back(std::move(item));
+
+        } else if (entry.kind == ObjectKind::kDirectory) {
+            // It's a directory; its contents have their own entries in the index
+            std::cerr << "Processing subdirectory: " << entry.Path() << std::endl;
+            OutputDirectory(ctx, entry.Path());
+
+        } else {
+            passThrough.push_back(n);
+        }
+    }
+
+    // With outlier detection they wait until the outliers are known
+    if (ctx.options.outlierThreshold > 0.0) {
+        ctx.deferredEntries = passThrough;
+    } else {
+        WritePassThrough(ctx, passThrough);
+    }
+}
+
+// Write the trees and other objects of the given entries of the key index
+void WritePassThrough(MergeContext& ctx, const std::vector<size_t>& entries) {
+    std::unique_ptr<TFile> passSource; // Input the last pass-through object came from, in streaming mode
+    size_t passSourceIndex = 0;
+    for (size_t n : entries) {
+        const KeyEntry& entry = ctx.entries[n];
+        TDirectory* outputDir = OutputDirectory(ctx, entry.dirPath);
+        if (entry.kind == ObjectKind::kTree) {
+            // It's a TTree: the inputs are appended to a clone of the first one
+            MergeStats::PhaseTimer timer(*ctx.stats, "clone trees");
+            MergeTree(ctx, entry, outputDir);
+
+        } else if (entry.kind == ObjectKind::kOther) {
+            // Other types of objects
+            // Copy their keys from the first file holding them
+            MergeStats::PhaseTimer timer(*ctx.stats, "copy other objects");
+            CopyKey(ctx, entry, outputDir, passSource, passSourceIndex);
+        }
+    }
+    if (passSource) ctx.stats->AddBytesRead(passSource->GetBytesRead());
+}
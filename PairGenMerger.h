@@ -0,0 +1,108 @@
+#ifndef PAIRGEN_MERGER_H
+#define PAIRGEN_MERGER_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+class MergeStats;
+
+// Merging of PairGen replica files. Every histogram of the output holds the mean over
+// the replicas as bin content and their spread as bin error, parameters are combined by
+// their TParameter merge mode (sum, product, maximum, minimum, first or last value;
+// constant parameters keep theirs) and trees are chained. Used by the pairgen-merge
+// executable and by the MergeSingleGenFiles() macro in merger_automatic_Nov4_versions.C.
+
+// Bin error stored in the merged histograms
+enum class ErrorPolicy {
+    kSpread,     // Standard deviation of the replicas (normalized by N)
+    kSample,     // Sample standard deviation (normalized by N - 1)
+    kErrorOfMean // Standard error of the mean, the spread over sqrt(N)
+};
+
+// One input of an input list
+struct InputSpec {
+    std::string fileName;
+    double weight = 1.0; // Weight of the replica in the means and spreads of the histograms
+    std::string label;   // Free text recorded with the input, e.g. a run or campaign name
+};
+
+// Options of a merge, given on the command line or as a string such as "--threads 8"
+struct MergeOptions {
+    std::string inputPattern = "*/PairGen.root";        // Glob of the input files
+    std::string inputListFileName;                      // Text or JSON list of the inputs, used instead of the glob
+    std::map<std::string, double> inputWeights;         // Weight of an input by file name, 1 if not listed
+    std::map<std::string, std::string> inputLabels;     // Label of an input by file name
+    std::string outputFileName = "PairGenMerged.root"; // Merged output file
+    ErrorPolicy errorPolicy = ErrorPolicy::kSpread;     // Bin error of the merged histograms
+    std::vector<double> quantiles;                      // Percent levels of extra per-bin quantile histograms, e.g. 16, 50, 84
+    unsigned bootstrap = 0;                             // Poisson bootstrap resamples of the bin means, 0 for none
+    std::vector<double> bootstrapLevels{2.5, 97.5};     // Percent levels of the bootstrap band histograms
+    unsigned bootstrapSeed = 0;                         // Seed of the bootstrap weights
+    bool jackknife = false;                             // Also write the delete-one jackknife variance of the bin means
+    std::string jackknifeRatioFileName;                 // Ratios of merged histograms with jackknife errors, none if empty
+    std::vector<std::string> covariancePatterns;        // Globs of the histogram paths that get a bin-to-bin covariance
+    unsigned covarianceBand = 0;                        // Covariance only within this many bins of the diagonal, 0 for all
+    double outlierThreshold = 0.0;                      // Chi2 per bin above which a replica is an outlier, 0 for no detection
+    bool outlierDownweight = false;                     // Down-weight outliers instead of leaving them out
+    unsigned outlierWarmup = 8;                         // Replicas compared with each other before there is a running mean
+    unsigned nOpenThreads = 16; // Threads scanning directories and checking input files
+    unsigned nThreads = 1; // Worker threads for histograms and parameters, 0 for all cores
+    unsigned maxOpen = 0;  // Streaming mode: at most this many inputs open at once, 0 to open all up front
+    bool keepState = false; // Store the per-bin merge state in the output, so it can be merged further
+    unsigned nGroups = 0;   // Hierarchical merge: number of groups merged separately, 0 for one flat merge
+    int groupIndex = -1;    // Only produce the partial file of this group
+    bool reduce = false;    // Only combine existing partial files into the output
+    bool incremental = false; // Only fold inputs missing from the manifest of an existing output
+    bool force = false;       // Merge even if the output records exactly the current inputs and settings
+    unsigned memoryBudgetMB = 0; // Streaming mode: estimated memory for accumulators and read inputs, 0 for no limit
+    int compression = -1;   // Compression settings of the output (algorithm * 100 + level), -1 for ROOT's default
+    std::string reportFileName; // JSON performance report of the merge, none if empty
+    bool reportObjects = false; // Add the per-object breakdown to the report
+};
+
+// Usage text of the merge options
+const char* MergeUsage();
+
+// Parse command-line style arguments or an option string into opts; returns false on
+// unknown or incomplete options
+bool ParseMergeOptions(const std::vector<std::string>& args, MergeOptions& opts);
+bool ParseMergeOptions(const std::string& text, MergeOptions& opts);
+
+// Compression settings for a preset ("fast-write", "balanced", "archive"), "none", or an
+// algorithm with an optional level such as "zstd:7" or "lz4"; returns false if unknown
+bool ParseCompression(const std::string& spec, int& settings);
+
+// Readable form of compression settings, e.g. "ZSTD:5"
+std::string CompressionName(int settings);
+
+// Read an input list: a text file with one input per line ("file [weight] [label]",
+// with "#" comments) or a JSON array of file names or of objects with "file", "weight"
+// and "label". Relative names are taken from the directory of the list.
+bool ReadInputList(const std::string& listFileName, std::vector<InputSpec>& inputs);
+
+// Files matching a glob pattern such as "*/PairGen.root" or "runs/**/PairGen.root", in
+// natural order (numbers in names compared by value), scanning on up to nThreads threads
+std::vector<std::string> DiscoverInputs(const std::string& pattern, unsigned nThreads = 1);
+
+// The inputs that can be opened and hold objects, in the same order, checked on up to
+// nThreads threads. The others are reported together.
+std::vector<std::string> ValidateInputs(const std::vector<std::string>& inputNames, unsigned nThreads = 1);
+
+// Partial files of a hierarchical merge into outputFileName, in group order
+std::vector<std::string> FindPartialFiles(const std::string& outputFileName);
+
+// Merge the given inputs into outputFileName in one pass, adding timers and counters
+// to stats
+bool MergeInputs(const std::vector<std::string>& inputNames, const std::string& outputFileName, const MergeOptions& options,
+                 MergeStats* stats = nullptr);
+
+// Merge options.nGroups groups of inputs in separate processes and combine the partial
+// files
+bool MergeGroups(const std::vector<std::string>& inputNames, const std::string& outputFileName, const MergeOptions& options,
+                 MergeStats* stats = nullptr);
+
+// Merge the inputs selected by the options into the output file
+bool RunMerge(const MergeOptions& options);
+
+#endif // PAIRGEN_MERGER_H
@@ -0,0 +1,127 @@
+#ifndef REPLICA_SCORE_H
+#define REPLICA_SCORE_H
+
+#include <vector>
+#include <limits>    // For the quiet NaN of missing values
+#include <algorithm> // For std::nth_element
+#include <cmath>     // For std::fabs
+#include <cstddef>   // For std::size_t
+#include "BinAccumulator.h"
+
+// Compatibility of one replica with the others: a chi2 summed over the bins of its
+// histograms and the number of bins that entered it. A replica that agrees with the
+// others within their spread scores about 1 per bin; a broken one (a crashed job, a
+// wrong seed) scores far more.
+struct ReplicaScore {
+    double chi2 = 0.0;
+    double ndf = 0.0;
+
+    void Add(const ReplicaScore& other) {
+        chi2 += other.chi2;
+        ndf += other.ndf;
+    }
+    double PerBin() const { return ndf > 0.0 ? chi2 / ndf : 0.0; }
+};
+
+// Score of one replica against the running moments of the replicas merged so far:
+//
+//     chi2 = sum_bins (x - mean)^2 / (s^2 (1 + 1 / W))
+//
+// with s^2 the sample variance and W the weight of the bin, the variance of the
+// difference of a new replica and the mean. Bins with at most one replica merged or
+// that did not vary are left out. Filled like BinAccumulator, bin by bin or with a whole
+// bin array; the weight is ignored.
+class PullScorer {
+public:
+    explicit PullScorer(const BinAccumulator& reference) : fReference(reference) {}
+
+    void Fill(std::size_t bin, double x, double = 1.0) {
+        double w = fReference.Weight(bin);
+        if (w <= 1.0) return;
+        double variance = fReference.M2(bin) / (w - 1.0);
+        if (variance <= 0.0) return;
+        double delta = x - fReference.Mean(bin);
+        fScore.chi2 += delta * delta / (variance * (1.0 + 1.0 / w));
+        fScore.ndf += 1.0;
+    }
+
+    template <typename T>
+    void FillArray(const T* values, double = 1.0) {
+        for (std::size_t bin = 0; bin < fReference.Size(); ++bin) Fill(bin, values[bin]);
+    }
+
+    const ReplicaScore& Score() const { return fScore; }
+
+private:
+    const BinAccumulator& fReference;
+    ReplicaScore fScore;
+};
+
+// Scores of a few replicas against each other while there are no running moments to
+// compare with yet. Every bin is compared with the median of the replicas, in units of
+// their median absolute deviation scaled to a standard deviation, which a single broken
+// replica among them does not move. Bins with fewer than three replicas or no deviation
+// are left out.
+//
+// Replica r is filled after Select(r), like BinAccumulator; replicas not filled for a
+// bin count as missing there.
+class MedianScorer {
+public:
+    static constexpr std::size_t kMinReplicas = 3; // Replicas a bin needs to be scored
+
+    MedianScorer() = default;
+    MedianScorer(std::size_t nBins, std::size_t nReplicas)
+        : fNBins(nBins), fNReplicas(nReplicas), fValue(nBins * nReplicas, std::numeric_limits<double>::quiet_NaN()) {}
+
+    std::size_t Size() const { return fNBins; }
+    void Select(std::size_t replica) { fRow = &fValue[replica * fNBins]; }
+
+    void Fill(std::size_t bin, double x, double = 1.0) { fRow[bin] = x; }
+
+    template <typename T>
+    void FillArray(const T* values, double = 1.0) {
+        for (std::size_t bin = 0; bin < fNBins; ++bin) fRow[bin] = values[bin];
+    }
+
+    // Add the score of every replica to scores[replica]
+    void AddScores(std::vector<ReplicaScore>& scores) const {
+        std::vector<double> column, deviation;
+        for (std::size_t bin = 0; bin < fNBins; ++bin) {
+            column.clear();
+            for (std::size_t r = 0; r < fNReplicas; ++r) {
+                double x = fValue[r * fNBins + bin];
+                if (x == x) column.push_back(x); // Not NaN
+            }
+            if (column.size() < kMinReplicas) continue;
+            double median = Median(column);
+            deviation.clear();
+            for (double x : column) deviation.push_back(std::fabs(x - median));
+            double sigma = 1.4826 * Median(deviation); // The standard deviation of a normal spread
+            if (sigma <= 0.0) continue;
+            for (std::size_t r = 0; r < fNReplicas; ++r) {
+                double x = fValue[r * fNBins + bin];
+                if (x != x) continue;
+                double pull = (x - median) / sigma;
+                scores[r].chi2 += pull * pull;
+                scores[r].ndf += 1.0;
+            }
+        }
+    }
+
+private:
+    // Median of values, which are reordered
+    static double Median(std::vector<double>& values) {
+        std::size_t half = values.size() / 2;
+        std::nth_element(values.begin(), values.begin() + half, values.end());
+        double upper = values[half];
+        if (values.size() % 2) return upper;
+        return 0.5 * (upper + *std::max_element(values.begin(), values.begin() + half));
+    }
+
+    std::size_t fNBins = 0;
+    std::size_t fNReplicas = 0;
+    std::vector<double> fValue; // Per replica and bin: the content, NaN if missing
+    double* fRow = nullptr;     // Row of the selected replica
+};
+
+#endif // REPLICA_SCORE_H
@@ -0,0 +1,129 @@
+#include "ReplicaGenerator.h"
+
+#include <filesystem>
+#include <memory>
+#include <cstdio> // For std::snprintf
+#include <TFile.h>
+#include <TH1.h>
+#include <TH2.h>
+#include <TH3.h>
+#include <TParameter.h>
+#include <TRandom3.h>
+#include <TTree.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Directories of a replica file: the top level and nDirectories chains of depth levels
+std::vector<std::string> DirectoryPaths(const ReplicaSpec& spec) {
+    std::vector<std::string> paths{""};
+    for (unsigned d = 0; d < spec.nDirectories; ++d) {
+        std::string path = "sub" + std::to_string(d);
+        for (unsigned level = 0; level < spec.depth; ++level) {
+            paths.push_back(path);
+            path += "/level" + std::to_string(level + 1);
+        }
+    }
+    return paths;
+}
+
+// Fill every cell, apart from a random fraction sparsity, with a Poisson count
+void FillCells(TH1* h, TRandom3& rng, double sparsity) {
+    for (int bin = 0; bin < h->GetNcells(); ++bin) {
+        if (sparsity > 0.0 && rng.Rndm() < sparsity) continue;
+        h->SetBinContent(bin, rng.Poisson(100.0));
+    }
+}
+
+// Write h into directory dirPath of file, creating the directory on first use
+void WriteTo(TFile& file, const std::string& dirPath, TH1* h) {
+    TDirectory* dir = dirPath.empty() ? (TDirectory*)&file : file.mkdir(dirPath.c_str(), "", true);
+    dir->WriteTObject(h);
+}
+
+// Write one replica file
+void WriteReplica(const std::string& fileName, const ReplicaSpec& spec, unsigned replica) {
+    TRandom3 rng(spec.seed * 100003 + replica);
+    std::vector<std::string> dirs = DirectoryPaths(spec);
+    TFile file(fileName.c_str(), "RECREATE");
+
+    // Histograms go round-robin over the directories; odd ones store floats
+    unsigned nHist = 0;
+    auto place = [&](TH1* h) {
+        h->SetDirectory(nullptr);
+        FillCells(h, rng, spec.sparsity);
+        WriteTo(file, dirs[nHist++ % dirs.size()], h);
+        delete h;
+    };
+    for (unsigned k = 0; k < spec.nHist1D; ++k) {
+        std::string name = "h1_" + std::to_string(k);
+        int n = spec.bins1D;
+        place(k % 2 ? (TH1*)new TH1F(name.c_str(), name.c_str(), n, 0, 1) : (TH1*)new TH1D(name.c_str(), name.c_str(), n, 0, 1));
+    }
+    for (unsigned k = 0; k < spec.nHist2D; ++k) {
+        std::string name = "h2_" + std::to_string(k);
+        int n = spec.bins2D;
+        place(k % 2 ? (TH1*)new TH2F(name.c_str(), name.c_str(), n, 0, 1, n, 0, 1)
+                    : (TH1*)new TH2D(name.c_str(), name.c_str(), n, 0, 1, n, 0, 1));
+    }
+    for (unsigned k = 0; k < spec.nHist3D; ++k) {
+        std::string name = "h3_" + std::to_string(k);
+        int n = spec.bins3D;
+        place(k % 2 ? (TH1*)new TH3F(name.c_str(), name.c_str(), n, 0, 1, n, 0, 1, n, 0, 1)
+                    : (TH1*)new TH3D(name.c_str(), name.c_str(), n, 0, 1, n, 0, 1, n, 0, 1));
+    }
+
+    // Even parameters are integer counters, odd ones doubles
+    for (unsigned k = 0; k < spec.nParameters; ++k) {
+        std::string name = "param_" + std::to_string(k);
+        if (k % 2) {
+            TParameter<double> param(name.c_str(), rng.Gaus(1000.0, 10.0));
+            file.WriteTObject(&param);
+        } else {
+            TParameter<Long64_t> param(name.c_str(), rng.Poisson(1000.0));
+            file.WriteTObject(&param);
+        }
+    }
+
+    if (spec.treeEntries > 0) {
+        file.cd();
+        // Deleted before the file is closed, which would otherwise delete it
+        std::unique_ptr<TTree> tree(new TTree("pairs", "Generated pairs"));
+        float pt, eta, phi;
+        int charge;
+        tree->Branch("pt", &pt, "pt/F");
+        tree->Branch("eta", &eta, "eta/F");
+        tree->Branch("phi", &phi, "phi/F");
+        tree->Branch("charge", &charge, "charge/I");
+        for (long long entry = 0; entry < spec.treeEntries; ++entry) {
+            pt = rng.Exp(1.0);
+            eta = rng.Uniform(-2.5, 2.5);
+            phi = rng.Uniform(-3.14159, 3.14159);
+            charge = rng.Rndm() < 0.5 ? -1 : 1;
+            tree->Fill();
+        }
+        tree->Write();
+    }
+    file.Close();
+}
+
+} // namespace
+
+ReplicaSummary GenerateReplicas(const std::string& baseDir, const ReplicaSpec& spec) {
+    ReplicaSummary summary;
+    summary.cellsPerReplica = (long long)spec.nHist1D * (spec.bins1D + 2) +
+                              (long long)spec.nHist2D * (spec.bins2D + 2) * (spec.bins2D + 2) +
+                              (long long)spec.nHist3D * (spec.bins3D + 2) * (spec.bins3D + 2) * (spec.bins3D + 2);
+    for (unsigned replica = 0; replica < spec.nReplicas; ++replica) {
+        char dirName[32];
+        std::snprintf(dirName, sizeof(dirName), "rep_%04u", replica);
+        fs::path dir = fs::path(baseDir) / dirName;
+        fs::create_directories(dir);
+        std::string fileName = (dir / "PairGen.root").string();
+        WriteReplica(fileName, spec, replica);
+        summary.fileNames.push_back(fileName);
+        summary.bytes += fs::file_size(fileName);
+    }
+    return summary;
+}
@@ -0,0 +1,38 @@
+#ifndef REPLICA_GENERATOR_H
+#define REPLICA_GENERATOR_H
+
+#include <string>
+#include <vector>
+
+// Synthetic PairGen replicas for benchmarking the merger. Every replica is a directory
+// rep_<i> holding a PairGen.root with the same layout: histograms of one to three
+// dimensions spread over the top level and nested subdirectories, parameters and a
+// tree of pairs. Bin contents are Poisson distributed and differ between replicas.
+
+struct ReplicaSpec {
+    unsigned nReplicas = 10;
+    unsigned nHist1D = 20;        // Number of 1D histograms
+    int bins1D = 1000;            // Bins of each 1D histogram
+    unsigned nHist2D = 5;
+    int bins2D = 100;             // Bins per axis of each 2D histogram
+    unsigned nHist3D = 1;
+    int bins3D = 20;              // Bins per axis of each 3D histogram
+    double sparsity = 0.0;        // Fraction of bins left empty
+    unsigned nParameters = 4;
+    unsigned nDirectories = 2;    // Subdirectories below the top level
+    unsigned depth = 1;           // Nesting depth of each subdirectory
+    long long treeEntries = 1000; // Entries of the pair tree, 0 for no tree
+    unsigned seed = 1;
+};
+
+// What was generated
+struct ReplicaSummary {
+    std::vector<std::string> fileNames; // One PairGen.root per replica, in order
+    long long cellsPerReplica = 0;      // Histogram cells (including under- and overflow) of one replica
+    long long bytes = 0;                // Total size of the files on disk
+};
+
+// Write the replicas of spec below baseDir, replacing replicas already there
+ReplicaSummary GenerateReplicas(const std::string& baseDir, const ReplicaSpec& spec);
+
+#endif // REPLICA_GENERATOR_H
@@ -0,0 +1,146 @@
+// pairgen-bench: end-to-end merge benchmarks on synthetic replicas, and the bin kernels
+// on their own. Merge results are reported as histogram cells folded per second
+// ("cells/s") and input megabytes per second ("MB/s"), plus the wall time of every
+// phase of the merge per iteration.
+#include "BinAccumulator.h"
+#include "BinCovariance.h"
+#include "MergeStats.h"
+#include "PairGenMerger.h"
+#include "ReplicaGenerator.h"
+
+#include <ROOT/TThreadExecutor.hxx>
+#include <benchmark/benchmark.h>
+#include <filesystem>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Replicas of a given count and size, generated once per process in the temp directory.
+// The size argument is the bin count of the 1D histograms; the 2D and 3D histograms are
+// scaled from it so that each class holds a comparable share of the cells.
+const ReplicaSummary& GetReplicas(unsigned nReplicas, int bins) {
+    static std::map<std::pair<unsigned, int>, ReplicaSummary> cache;
+    auto key = std::make_pair(nReplicas, bins);
+    auto found = cache.find(key);
+    if (found != cache.end()) return found->second;
+
+    ReplicaSpec spec;
+    spec.nReplicas = nReplicas;
+    spec.bins1D = bins;
+    spec.bins2D = std::max(2, bins / 10);
+    spec.bins3D = std::max(2, bins / 50);
+    fs::path dir = fs::temp_directory_path() / "pairgen-bench" / (std::to_string(nReplicas) + "x" + std::to_string(bins));
+    fs::remove_all(dir);
+    return cache.emplace(key, GenerateReplicas(dir.string(), spec)).first->second;
+}
+
+// Merge the replicas of the benchmark arguments (count, size) with the given options
+void RunMergeBenchmark(benchmark::State& state, MergeOptions options) {
+    const ReplicaSummary& replicas = GetReplicas(state.range(0), state.range(1));
+    std::string outputFileName = (fs::temp_directory_path() / "pairgen-bench" / "merged.root").string();
+
+    MergeStats stats;
+    for (auto _ : state) {
+        if (!MergeInputs(replicas.fileNames, outputFileName, options, &stats)) {
+            state.SkipWithError("Merge failed");
+            break;
+        }
+    }
+
+    double cells = double(replicas.cellsPerReplica) * replicas.fileNames.size();
+    state.counters["cells/s"] = benchmark::Counter(cells, benchmark::Counter::kIsIterationInvariantRate);
+    state.counters["MB/s"] = benchmark::Counter(replicas.bytes / 1e6, benchmark::Counter::kIsIterationInvariantRate);
+    for (const auto& phase : stats.PhaseTimings()) {
+        state.counters[phase.first] = benchmark::Counter(phase.second, benchmark::Counter::kAvgIterations);
+    }
+    fs::remove(outputFileName);
+}
+
+void BM_MergeSerial(benchmark::State& state) {
+    RunMergeBenchmark(state, MergeOptions());
+}
+
+void BM_MergeThreads(benchmark::State& state) {
+    MergeOptions options;
+    options.nThreads = 0;
+    RunMergeBenchmark(state, options);
+}
+
+void BM_MergeStreaming(benchmark::State& state) {
+    MergeOptions options;
+    options.nThreads = 0;
+    options.maxOpen = 8;
+    RunMergeBenchmark(state, options);
+}
+
+// Output compression presets, on all cores
+void BM_MergeCompression(benchmark::State& state, const char* preset) {
+    MergeOptions options;
+    options.nThreads = 0;
+    ParseCompression(preset, options.compression);
+    RunMergeBenchmark(state, options);
+}
+
+// Folding one bin array into the accumulator, by bin type and number of cells
+template <typename T>
+void BM_FoldKernel(benchmark::State& state) {
+    size_t nCells = state.range(0);
+    std::mt19937 rng(1);
+    std::poisson_distribution<int> poisson(100.0);
+    std::vector<T> values(nCells);
+    for (auto& v : values) v = poisson(rng);
+
+    BinAccumulator acc(nCells);
+    for (auto _ : state) {
+        acc.FillArray(values.data());
+        benchmark::DoNotOptimize(acc.GetMeanArray());
+    }
+    state.counters["cells/s"] = benchmark::Counter(nCells, benchmark::Counter::kIsIterationInvariantRate);
+    state.SetLabel(BinKernels::IsaName(BinKernels::DetectIsa()));
+}
+
+// Rank-k covariance updates of one block of replicas, by number of bins and band (0 for
+// the full matrix); "updates/s" counts matrix elements times replicas
+void BM_CovarianceBlock(benchmark::State& state) {
+    size_t nBins = state.range(0);
+    size_t band = state.range(1);
+    std::mt19937 rng(1);
+    std::normal_distribution<double> normal(100.0, 10.0);
+    std::vector<double> values(BinCovariance::kDefaultBlockSize * nBins);
+    for (auto& v : values) v = normal(rng);
+
+    ROOT::TThreadExecutor pool(std::thread::hardware_concurrency());
+    BinCovariance covariance(nBins, band);
+    covariance.SetExecutor([&pool](size_t n, const std::function<void(size_t)>& body) {
+        pool.Foreach([&body](unsigned t) { body(t); }, ROOT::TSeqU(n));
+    });
+    for (auto _ : state) {
+        for (size_t r = 0; r < BinCovariance::kDefaultBlockSize; ++r) covariance.Fill(&values[r * nBins]);
+        benchmark::DoNotOptimize(covariance.GetComomentArray());
+    }
+    state.counters["updates/s"] = benchmark::Counter((double)covariance.ComomentSize() * BinCovariance::kDefaultBlockSize,
+                                                     benchmark::Counter::kIsIterationInvariantRate);
+    state.counters["MB"] = BinCovariance::Footprint(nBins, band) / 1048576.0;
+}
+
+} // namespace
+
+// Replica count x 1D bin count
+#define MERGE_ARGS ->ArgsProduct({{10, 100}, {100, 1000, 10000}})->Unit(benchmark::kMillisecond)->UseRealTime()
+
+BENCHMARK(BM_MergeSerial) MERGE_ARGS;
+BENCHMARK(BM_MergeThreads) MERGE_ARGS;
+BENCHMARK(BM_MergeStreaming) MERGE_ARGS;
+BENCHMARK_CAPTURE(BM_MergeCompression, fast_write, "fast-write") MERGE_ARGS;
+BENCHMARK_CAPTURE(BM_MergeCompression, archive, "archive") MERGE_ARGS;
+BENCHMARK_TEMPLATE(BM_FoldKernel, double)->RangeMultiplier(8)->Range(1 << 10, 1 << 22);
+BENCHMARK_TEMPLATE(BM_FoldKernel, float)->RangeMultiplier(8)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_CovarianceBlock)->ArgsProduct({{500, 2000}, {0, 50}})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,96 @@
+// pairgen-generate: write synthetic PairGen replicas for benchmarking the merger
+#include "ReplicaGenerator.h"
+#include <iostream>
+#include <sstream>
+#include <string>
+
+namespace {
+
+const char* kUsage =
+    "Usage: pairgen-generate [options]\n"
+    "Write N replica directories rep_<i>/PairGen.root for benchmarking pairgen-merge.\n"
+    "\n"
+    "  --out D          Base directory of the replicas (default \"replicas\")\n"
+    "  --replicas N     Number of replicas (default 10)\n"
+    "  --hist1d N       1D histograms per replica (default 20)\n"
+    "  --bins1d N       Bins of each 1D histogram (default 1000)\n"
+    "  --hist2d N       2D histograms per replica (default 5)\n"
+    "  --bins2d N       Bins per axis of each 2D histogram (default 100)\n"
+    "  --hist3d N       3D histograms per replica (default 1)\n"
+    "  --bins3d N       Bins per axis of each 3D histogram (default 20)\n"
+    "  --sparsity F     Fraction of bins left empty (default 0)\n"
+    "  --parameters N   Parameters per replica (default 4)\n"
+    "  --dirs N         Subdirectories below the top level (default 2)\n"
+    "  --depth N        Nesting depth of each subdirectory (default 1)\n"
+    "  --tree-entries N Entries of the pair tree, 0 for no tree (default 1000)\n"
+    "  --seed N         Random seed (default 1)\n";
+
+// Parse the value following argument i into out
+template <typename T>
+bool ParseValue(int argc, char** argv, int& i, T& out) {
+    if (i + 1 >= argc) {
+        std::cerr << "Option " << argv[i] << " needs a value" << std::endl;
+        return false;
+    }
+    std::istringstream in(argv[++i]);
+    if (!(in >> out) || !in.eof()) {
+        std::cerr << "Option " << argv[i - 1] << " got an invalid value " << argv[i] << std::endl;
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    ReplicaSpec spec;
+    std::string baseDir = "replicas";
+    for (int i = 1; i < argc; ++i) {
+        std::string flag = argv[i];
+        bool ok = true;
+        if (flag == "-h" || flag == "--help") {
+            std::cout << kUsage;
+            return 0;
+        } else if (flag == "--out") {
+            ok = ParseValue(argc, argv, i, baseDir);
+        } else if (flag == "--replicas") {
+            ok = ParseValue(argc, argv, i, spec.nReplicas);
+        } else if (flag == "--hist1d") {
+            ok = ParseValue(argc, argv, i, spec.nHist1D);
+        } else if (flag == "--bins1d") {
+            ok = ParseValue(argc, argv, i, spec.bins1D);
+        } else if (flag == "--hist2d") {
+            ok = ParseValue(argc, argv, i, spec.nHist2D);
+        } else if (flag == "--bins2d") {
+            ok = ParseValue(argc, argv, i, spec.bins2D);
+        } else if (flag == "--hist3d") {
+            ok = ParseValue(argc, argv, i, spec.nHist3D);
+        } else if (flag == "--bins3d") {
+            ok = ParseValue(argc, argv, i, spec.bins3D);
+        } else if (flag == "--sparsity") {
+            ok = ParseValue(argc, argv, i, spec.sparsity);
+        } else if (flag == "--parameters") {
+            ok = ParseValue(argc, argv, i, spec.nParameters);
+        } else if (flag == "--dirs") {
+            ok = ParseValue(argc, argv, i, spec.nDirectories);
+        } else if (flag == "--depth") {
+            ok = ParseValue(argc, argv, i, spec.depth);
+        } else if (flag == "--tree-entries") {
+            ok = ParseValue(argc, argv, i, spec.treeEntries);
+        } else if (flag == "--seed") {
+            ok = ParseValue(argc, argv, i, spec.seed);
+        } else {
+            std::cerr << "Unknown option " << flag << std::endl;
+            ok = false;
+        }
+        if (!ok) {
+            std::cerr << kUsage;
+            return 2;
+        }
+    }
+
+    ReplicaSummary summary = GenerateReplicas(baseDir, spec);
+    std::cout << "Wrote " << summary.fileNames.size() << " replicas with " << summary.cellsPerReplica
+              << " histogram cells each (" << summary.bytes / 1e6 << " MB) below " << baseDir << std::endl;
+    return 0;
+}
@@ -0,0 +1,22 @@
+// pairgen-merge: command-line front end of the PairGenMerger library
+#include "PairGenMerger.h"
+#include <iostream>
+#include <string>
+#include <vector>
+
+int main(int argc, char** argv) {
+    std::vector<std::string> args(argv + 1, argv + argc);
+    for (const auto& arg : args) {
+        if (arg == "-h" || arg == "--help") {
+            std::cout << MergeUsage();
+            return 0;
+        }
+    }
+
+    MergeOptions opts;
+    if (!ParseMergeOptions(args, opts)) {
+        std::cerr << MergeUsage();
+        return 2;
+    }
+    return RunMerge(opts) ? 0 : 1;
+}